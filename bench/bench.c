@@ -0,0 +1,318 @@
+// Replays keystroke scripts against generated files through the headless
+// editor core and reports latency percentiles for every script.
+//
+//     femto-bench [-s scriptdir] lines...
+//
+// A file of each size is generated once in $TMPDIR. Each script then runs in
+// a child process of its own on a fresh editor, so earlier runs leave no rows,
+// caches or threads behind, and saves to a scratch file next to it so that
+// the generated file stays the same for every run.
+//
+// A script (bench/scripts/*.keys) has one step per line, optionally repeated
+// as "N* ...". A step is a run of "quoted text" (\r \n \t \e escapes) and
+// <key> names: enter tab bs del esc up down left right home end pgup pgdn,
+// ctrl-x, and <paste N> for a bracketed paste of N lines. Everything after
+// '#' at the start of a line is a comment.
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "femto.h"
+
+#define BENCH_ROWS 24
+#define BENCH_COLS 80
+#define BENCH_SCRIPTS 64
+
+// One line of a script: its keys are fed and applied as a batch, then timed
+// until the frame is drawn and any save it started has finished.
+struct step {
+    char* keys;
+    size_t len;
+    int repeat;
+};
+
+struct script {
+    char name[64];
+    struct step* steps;
+    int nsteps;
+};
+
+void fail(const char* what) {
+    perror(what);
+    exit(1);
+}
+
+long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void keysAppend(struct step* st, size_t* cap, const char* s, size_t len) {
+    if (st->len + len > *cap) {
+        *cap = (st->len + len) * 2;
+        st->keys = realloc(st->keys, *cap);
+        if (st->keys == NULL) fail("realloc");
+    }
+    memcpy(&st->keys[st->len], s, len);
+    st->len += len;
+}
+
+// keys for a <name> token; a bracketed paste is generated for <paste N>
+int keysNamed(struct step* st, size_t* cap, const char* name) {
+    static const struct {
+        const char* name;
+        const char* keys;
+    } named[] = {
+        {"enter", "\r"}, {"tab", "\t"}, {"bs", "\x7f"}, {"esc", "\x1b"},
+        {"up", "\x1b[A"}, {"down", "\x1b[B"}, {"right", "\x1b[C"}, {"left", "\x1b[D"},
+        {"home", "\x1b[H"}, {"end", "\x1b[F"}, {"del", "\x1b[3~"},
+        {"pgup", "\x1b[5~"}, {"pgdn", "\x1b[6~"},
+    };
+    for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+        if (strcmp(name, named[i].name) == 0) {
+            keysAppend(st, cap, named[i].keys, strlen(named[i].keys));
+            return 0;
+        }
+    }
+    if (strncmp(name, "ctrl-", 5) == 0 && name[5] && !name[6]) {
+        char c = name[5] & 0x1f;
+        keysAppend(st, cap, &c, 1);
+        return 0;
+    }
+    int lines;
+    if (sscanf(name, "paste %d", &lines) == 1) {
+        char line[80];
+        keysAppend(st, cap, "\x1b[200~", 6);
+        for (int i = 0; i < lines; i++) {
+            int n = snprintf(line, sizeof(line), "pasted line %d of the bench clipboard\r", i);
+            keysAppend(st, cap, line, n);
+        }
+        keysAppend(st, cap, "\x1b[201~", 6);
+        return 0;
+    }
+    return -1;
+}
+
+// parses one script line into st; returns 0 for a blank or comment line
+int stepParse(struct step* st, const char* line, const char* path, int lineno) {
+    size_t cap = 0;
+    const char* p = line;
+    st->keys = NULL;
+    st->len = 0;
+    st->repeat = 1;
+
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p == '#' || *p == '\n' || *p == '\0') return 0;
+    int n = 0;
+    if (sscanf(p, "%d*%n", &st->repeat, &n) == 1 && n > 0) p += n;
+    else st->repeat = 1;
+
+    while (*p) {
+        if (*p == ' ' || *p == '\t' || *p == '\n') {
+            p++;
+        } else if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) {
+                char c = *p;
+                if (c == '\\' && p[1]) {
+                    switch (*++p) {
+                        case 'r': c = '\r'; break;
+                        case 'n': c = '\n'; break;
+                        case 't': c = '\t'; break;
+                        case 'e': c = '\x1b'; break;
+                        default: c = *p; break;
+                    }
+                }
+                keysAppend(st, &cap, &c, 1);
+            }
+            if (*p == '"') p++;
+        } else if (*p == '<') {
+            const char* end = strchr(p, '>');
+            char name[32];
+            if (end == NULL || end - p - 1 >= (int)sizeof(name)) break;
+            memcpy(name, p + 1, end - p - 1);
+            name[end - p - 1] = '\0';
+            if (keysNamed(st, &cap, name) == -1) break;
+            p = end + 1;
+        } else {
+            break;
+        }
+    }
+    if (*p) {
+        fprintf(stderr, "%s:%d: cannot parse '%s'\n", path, lineno, p);
+        exit(1);
+    }
+    return 1;
+}
+
+void scriptLoad(struct script* sc, const char* dir, const char* file) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) fail(path);
+
+    snprintf(sc->name, sizeof(sc->name), "%.*s", (int)(strlen(file) - 5), file);
+    sc->steps = NULL;
+    sc->nsteps = 0;
+    char* line = NULL;
+    size_t linecap = 0;
+    int lineno = 0;
+    while (getline(&line, &linecap, fp) != -1) {
+        struct step st;
+        if (!stepParse(&st, line, path, ++lineno)) continue;
+        sc->steps = realloc(sc->steps, (sc->nsteps + 1) * sizeof(struct step));
+        if (sc->steps == NULL) fail("realloc");
+        sc->steps[sc->nsteps++] = st;
+    }
+    free(line);
+    fclose(fp);
+}
+
+int scriptCmp(const void* a, const void* b) {
+    return strcmp(((const struct script*)a)->name, ((const struct script*)b)->name);
+}
+
+// the *.keys scripts in dir, by name
+int scriptLoadAll(struct script* scripts, const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) fail(dir);
+    int n = 0;
+    struct dirent* ent;
+    while ((ent = readdir(d)) && n < BENCH_SCRIPTS) {
+        size_t len = strlen(ent->d_name);
+        if (len > 5 && strcmp(&ent->d_name[len - 5], ".keys") == 0) {
+            scriptLoad(&scripts[n++], dir, ent->d_name);
+        }
+    }
+    closedir(d);
+    qsort(scripts, n, sizeof(struct script), scriptCmp);
+    return n;
+}
+
+// writes a file of the given number of lines unless it already exists
+void generate(const char* path, long lines) {
+    struct stat st;
+    if (stat(path, &st) == 0) return;
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) fail(path);
+    setvbuf(fp, NULL, _IOFBF, 1 << 20);
+    for (long i = 0; i < lines; i++) {
+        // every eighth line is indented with tabs
+        fprintf(fp, "%sline %ld: the quick brown fox jumps over the lazy dog\n",
+                i % 8 == 0 ? "\t\t" : "", i);
+    }
+    if (fclose(fp) == EOF) fail(path);
+}
+
+int llCmp(const void* a, const void* b) {
+    long long x = *(const long long*)a, y = *(const long long*)b;
+    return x < y ? -1 : x > y;
+}
+
+void report(const char* name, long lines, long long* ns, int n) {
+    qsort(ns, n, sizeof(long long), llCmp);
+    double us[4];
+    const double at[4] = {0.50, 0.90, 0.99, 1.0};
+    for (int i = 0; i < 4; i++) {
+        int k = (int)(at[i] * n + 0.5) - 1;
+        if (k < 0) k = 0;
+        if (k >= n) k = n - 1;
+        us[i] = ns[k] / 1000.0;
+    }
+    printf("%-10s %10ld %7d %11.1f %11.1f %11.1f %11.1f\n",
+            name, lines, n, us[0], us[1], us[2], us[3]);
+    fflush(stdout);
+}
+
+// runs one script on a fresh editor; called in a child process
+void run(struct script* sc, const char* path, long lines, int showopen) {
+    char scratch[1024];
+    snprintf(scratch, sizeof(scratch), "%.*s.%ld.txt", (int)(strlen(path) - 4), path, (long)getpid());
+    long long t = nowNs();
+    initEditor(BENCH_ROWS, BENCH_COLS);
+    editorOpen((char*)path);
+    editorSetFilename(scratch);
+    editorRunPending();
+    long long paint = nowNs() - t;
+    // the scripts run on the whole file
+    editorLoadFinish();
+    editorRunPending();
+    long long open = nowNs() - t;
+    if (showopen) {
+        report("paint", lines, &paint, 1);
+        report("open", lines, &open, 1);
+    }
+
+    int n = 0;
+    for (int i = 0; i < sc->nsteps; i++) n += sc->steps[i].repeat;
+    long long* ns = malloc(n * sizeof(long long));
+    if (ns == NULL) fail("malloc");
+
+    int k = 0;
+    for (int i = 0; i < sc->nsteps; i++) {
+        struct step* st = &sc->steps[i];
+        for (int r = 0; r < st->repeat; r++) {
+            t = nowNs();
+            editorFeed(st->keys, st->len);
+            editorRunPending();
+            editorSaveFinish(1);
+            ns[k++] = nowNs() - t;
+        }
+    }
+    report(sc->name, lines, ns, n);
+    unlink(scratch);
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = "bench/scripts";
+    int opt;
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt == 's') {
+            dir = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-s scriptdir] lines...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-s scriptdir] lines...\n", argv[0]);
+        return 1;
+    }
+
+    static struct script scripts[BENCH_SCRIPTS];
+    int nscripts = scriptLoadAll(scripts, dir);
+    const char* tmp = getenv("TMPDIR");
+    if (tmp == NULL) tmp = "/tmp";
+
+    printf("%-10s %10s %7s %11s %11s %11s %11s\n",
+            "script", "lines", "steps", "p50 us", "p90 us", "p99 us", "max us");
+    for (int a = optind; a < argc; a++) {
+        long lines = atol(argv[a]);
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/femto-bench-%ld.txt", tmp, lines);
+        generate(path, lines);
+
+        for (int i = 0; i < nscripts; i++) {
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == -1) fail("fork");
+            if (pid == 0) {
+                run(&scripts[i], path, lines, i == 0);
+                _exit(0);
+            }
+            int status;
+            if (waitpid(pid, &status, 0) == -1) fail("waitpid");
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                fprintf(stderr, "%s on %ld lines failed\n", scripts[i].name, lines);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -5,6 +5,7 @@
 #define _GNU_SOURCE
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
 #include <string.h>
 #include <ctype.h>
@@ -14,14 +15,42 @@
 #include <termios.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include "femto.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FEMTO_X86 1
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#define FEMTO_INOTIFY 1
+#endif
 
 /*** fields ***/
 
 #define FEMTO_VERS "1.0.0"
 #define FEMTO_TAB_STOP 8
 #define FEMTO_QUIT_TIMES 2
+#define FEMTO_GAP_MIN 64 // smallest gap opened in the row being typed into
+#define FEMTO_MMAP_MIN (1 << 20) // files at least this big are mapped, not read
+#define FEMTO_IOV_MAX (IOV_MAX < 1024 ? IOV_MAX : 1024) // iovecs per writev when saving
+#define FEMTO_FIND_CHUNK 16384 // rows a search worker claims at a time
+#define FEMTO_FIND_THREADS 8 // most search worker threads
+#define FEMTO_INPUT_SIZE (64 * 1024) // input ring buffer, a power of two
+#define FEMTO_ESC_TIMEOUT 100 // ms to wait for the rest of an escape sequence
+#define FEMTO_MSG_TIMEOUT 5000 // ms a status message stays up
+#ifndef FEMTO_FRAME_MS
+#define FEMTO_FRAME_MS 0 // least ms between frames while keys keep coming, 0 for no cap
+#endif
 #define CTRL_KEY(k) ((k) & 0x1f)
 
 enum editorKey {
@@ -34,29 +63,604 @@ enum editorKey {
     PAGE_DOWN,
     HOME_KEY,
     END_KEY,
-    DEL_KEY
+    DEL_KEY,
+    WAKE_KEY, // not a key: background work, a resize or a timer wants a redraw
+    PASTE_KEY // not a key: a bracketed paste, its text is in E.paste
 };
+// Where the tabs of a row are, so cursor and render columns convert with a
+// binary search. The index is built from the left only as far as a lookup
+// needs and cut back to the edited column when the row changes, so typing at
+// the end of a long line never rescans it. In a row that is not plain ASCII
+// every character whose width differs from its length in bytes is a stop too.
+struct tabstop {
+    int cx; // column of the tab or character in chars
+    int rx; // render column just after it
+    int len; // its length in chars
+};
+
+struct tabindex {
+    int valid; // chars before this column are indexed
+    int n;
+    int cap;
+    struct tabstop tab[];
+};
+
+enum rowAscii { ROW_UNCHECKED, ROW_ASCII, ROW_UTF8 };
+
 typedef struct erow {
     int size;
-    int rsize;
+    int rslot : 22; // render cache slot, ours while its stamp is rstamp
+    unsigned ascii : 2; // ROW_ASCII if every byte is ASCII (tabs included), once checked
+    unsigned hlstate : 8; // lexer state at the end of the row, see struct highlight
     char* chars;
-    char* render;
+    const char* view; // line text in the file mapping, kept until the row is edited
+    struct tabindex* tabs; // NULL until a column lookup needs it
+    unsigned long long rstamp; // 0 until drawn and again after an edit
 } erow;
 
+// Rows live in the leaves of a B+ tree: interior nodes keep the row count of
+// their subtree so a line can be found, inserted or deleted in O(log n), and
+// leaves are chained so that walking the buffer in order stays cheap.
+// While soft-wrapping, leaves also keep the render width of each row and
+// every node the screen lines of its subtree, so the row shown on a screen
+// line is found the same way.
+#define FEMTO_LEAF_ROWS 64
+#define FEMTO_NODE_KIDS 32
+
+typedef struct rnode {
+    int leaf;
+    int n; // rows held by a leaf, or children of an interior node
+    int nrows; // rows in the whole subtree
+    int nlines; // screen lines of the subtree while soft-wrapping
+    struct rnode* parent;
+    struct rnode* prev; // neighbouring leaves
+    struct rnode* next;
+    erow* rows;
+    int* widths; // render width of each row of a leaf, while soft-wrapping
+    char* packed; // compressed text of a packed leaf's rows, see struct coldcache
+    size_t packedsize;
+    size_t rawsize; // length of that text, a newline after every row
+    struct rnode* kids[FEMTO_NODE_KIDS];
+} rnode;
+
+// remembers the last leaf visited so sequential row lookups are O(1)
+struct rowpos {
+    rnode* leaf;
+    int first; // buffer index of leaf->rows[0]
+};
+
+// Row text and render buffers come from a femto-owned allocator instead of
+// one malloc each. Blocks up to FEMTO_MEM_SMALL bytes are rounded to a
+// multiple of FEMTO_MEM_ALIGN and carved from per size class slabs, or from
+// a shared bump arena while a file is being loaded; freed blocks go on a
+// free list for their class. Bigger blocks fall through to malloc.
+#define FEMTO_MEM_ALIGN 16
+#define FEMTO_MEM_SMALL 256
+#define FEMTO_MEM_CLASSES (FEMTO_MEM_SMALL / FEMTO_MEM_ALIGN + 1)
+#define FEMTO_SLAB_SIZE (64 * 1024)
+#define FEMTO_ARENA_SIZE (1024 * 1024)
+
+struct rowmem {
+    int bulk; // rows are being read from a file: carve new blocks from the arena
+    char* arena;
+    size_t arenaleft;
+    char* slab[FEMTO_MEM_CLASSES];
+    size_t slableft[FEMTO_MEM_CLASSES];
+    void* freelist[FEMTO_MEM_CLASSES];
+    // counters for the status bar
+    size_t chunkbytes; // slabs and arenas obtained from malloc
+    size_t largebytes; // live blocks bigger than FEMTO_MEM_SMALL
+    size_t livebytes; // live small blocks
+    size_t freebytes; // small blocks waiting on a free list
+    size_t treebytes; // row tree nodes
+    long mallocs;
+};
+
+// The row being typed into keeps a gap at the cursor, so inserting or
+// deleting a character there moves no text. Only one row is gapped at a time
+// and it is recognised by its chars pointer.
+struct gapbuf {
+    char* chars; // chars of the gapped row, or NULL
+    int at; // gap position
+    int len; // gap length
+    int tail; // bytes after the gap, including the terminating NUL
+};
+
+// Rows are tab-expanded for the screen only when they are drawn. The result
+// goes into one of a bounded set of slots, reused least recently drawn first,
+// so rendered text costs memory for about a screenful of rows instead of for
+// the whole file. Slots do not point back at rows, which move around in the
+// tree: a row owns its slot while the slot's stamp equals the row's rstamp.
+#define FEMTO_RENDER_ROWS 256 // rendered rows kept, at least twice the screen height
+
+struct renderslot {
+    char* render;
+    int rsize;
+    int cap; // bytes allocated for render
+    unsigned long long stamp; // rstamp of the row rendered here, 0 if none
+    int prev, next; // LRU list, most recently drawn first
+    unsigned char* hl; // FEMTO_ATTR_* of each render byte, valid if hlok
+    int hlcap;
+    int hlok;
+    int hlstart; // lexer state hl was built from
+    int hlend; // and the state it ended in
+};
+
+struct rendercache {
+    struct renderslot* slot;
+    int n;
+    int head, tail;
+    unsigned long long stamp; // last stamp handed out
+};
+
+// Bytes read from the terminal wait here until they are parsed into keys.
+// head and tail run freely and are masked on use, so tail - head is the
+// number of bytes buffered.
+struct inring {
+    unsigned char buf[FEMTO_INPUT_SIZE];
+    unsigned head; // next byte to parse
+    unsigned tail; // where the next read stores
+};
+
+// text of the last bracketed paste, with line breaks turned into '\n'
+struct pastebuf {
+    char* text;
+    size_t len;
+    size_t cap;
+};
+
+// A screenful of cells. The screen is drawn into a back frame and only the
+// cells that differ from the front frame, what the terminal shows, are sent.
+// A cell holds the UTF-8 bytes of one grapheme cluster packed into an
+// integer, first byte lowest; the cell right of a wide one holds 0.
+#define FEMTO_ATTR_NORMAL 0
+#define FEMTO_ATTR_INVERSE 1
+#define FEMTO_ATTR_COMMENT 2 // syntax highlighting colours
+#define FEMTO_ATTR_KEYWORD 3
+#define FEMTO_ATTR_TYPE 4
+#define FEMTO_ATTR_STRING 5
+#define FEMTO_ATTR_NUMBER 6
+#define FEMTO_DIFF_GAP 8 // unchanged cells worth rewriting to avoid a cursor move
+
+struct frame {
+    int rows;
+    int cols;
+    uint64_t* cells;
+    unsigned char* attrs;
+    int y; // pen position and attribute used by framePuts
+    int x;
+    unsigned char attr;
+};
+
+// Syntax highlighting. A lexer pass over a row needs only the state the row
+// before it ended in, which is kept in every erow: rows are lexed in order,
+// lazily, as far down as the screen shows. An edit marks rows dirty and
+// lexing resumes from the first of them, stopping once a row ends in the
+// same state as before, since everything after it is then still right. The
+// colours themselves are kept only for rendered rows, next to their render.
+enum hlState {
+    HL_NORMAL,
+    HL_COMMENT, // inside a block comment
+    // otherwise the quote of a string continued on the next line
+};
+
+struct syntax {
+    const char* filetype;
+    const char** filematch; // file name suffixes
+    const char** keywords; // those ending in '|' are types
+    const char* linecomment;
+    const char* blockstart;
+    const char* blockend;
+};
+
+// Rows below lo end in the state stored with them. Rows from hi up to lexed
+// do too, provided the row before them does; rows between lo and hi were
+// edited or got a new neighbour above. Rows from lexed on were never lexed.
+struct highlight {
+    struct syntax* syntax; // NULL: no highlighting
+    int lo;
+    int hi;
+    int lexed;
+};
+
+// Per-key latency, recorded when FEMTO_PROFILE names a report file. Each key
+// is timed from the moment its bytes were read through parsing, editing,
+// building the frame and writing it out. Histograms are log-linear: exact
+// below 16, then 8 buckets per power of two, so percentiles are within 12.5%.
+#define FEMTO_HIST_BUCKETS 512
+
+enum profPhase {
+    PROF_PARSE, // bytes read to key returned by editorReadKey
+    PROF_EDIT, // the key applied to the buffer
+    PROF_RENDER, // frame drawn and diffed against the terminal
+    PROF_WRITE, // frame written to the terminal
+    PROF_KEY, // bytes read to frame written, for the first key of a frame
+    PROF_BYTES, // bytes written per frame
+    PROF_PHASES
+};
+
+struct histogram {
+    long long count;
+    long long sum;
+    long long max;
+    long long bucket[FEMTO_HIST_BUCKETS];
+};
+
+struct profile {
+    const char* path; // the report is written here on exit; NULL when not profiling
+    long long ready; // editorNowNs() when input for the next frame was read, or 0
+    long long frames; // frames drawn, so a key that ran a prompt is left out
+    struct histogram hist[PROF_PHASES];
+};
+
+// Regex search. A pattern is parsed into a small syntax tree and compiled
+// into a Thompson NFA, forwards to find where the earliest match ends and
+// backwards to find where it starts. The NFAs become DFAs lazily: a DFA state
+// is a set of NFA states, built the first time a byte class leads to it, so a
+// row is scanned in linear time and no pattern can backtrack. Each search
+// thread has its own DFA cache, flushed when it gets too big. ^ and $ are
+// assertions on the edges of the scan: they hold in the start state of a scan
+// from the row's edge, and in one last step, RE_EDGE, taken at the other.
+#define FEMTO_RE_STATES 1024 // cached DFA states per thread
+#define FEMTO_RE_CACHE 4 // compiled patterns kept while the prompt is edited
+
+enum reSymbol { RE_EDGE = 256, RE_SYMS };
+enum reOp {
+    RE_SET, RE_EMPTY, RE_CAT, RE_ALT, RE_STAR, RE_PLUS, RE_QUEST,
+    RE_BEGIN, // where the scan started: ^ forwards, $ backwards
+    RE_END, // where the scan ends: $ forwards, ^ backwards
+    RE_SPLIT, RE_MATCH
+};
+
+struct reset {
+    unsigned char bits[(RE_SYMS + 7) / 8];
+};
+
+struct renode { // syntax tree node
+    int op;
+    int a; // operands, or the set of RE_SET
+    int b;
+    int lit; // the byte an RE_SET matches if it is a single one, else -1
+};
+
+struct restate { // NFA state
+    int op; // RE_SET consumes a byte, RE_SPLIT branches, RE_MATCH accepts
+    int out;
+    int out1;
+    int set;
+};
+
+struct regex;
+
+struct redfa {
+    struct regex* re;
+    struct restate* nfa;
+    int startnfa;
+    int unanchored; // a match may start anywhere: the start state is re-entered at each step
+    int nstates;
+    int cap;
+    int start[3]; // DFA start states inside the row, at its edge, in an empty row; or -1
+    int flushes;
+    int* next; // nstates * re->nclasses transitions, each state + 1 or 0 if not built yet
+    int* first; // where each state's NFA states begin in lists
+    int* count;
+    unsigned char* accept;
+    int* lists;
+    int nlists;
+    int listcap;
+    int* hash; // state + 1 by NFA state set, open addressing
+    int* mark; // closure bookkeeping, one slot per NFA state
+    int* stack;
+    int* scratch;
+    int gen;
+};
+
+struct regex {
+    char* pattern;
+    char* prefix; // literal text every match starts with
+    int literal; // the pattern is just prefix
+    struct reset* sets;
+    int nsets;
+    int classmap[RE_SYMS]; // bytes no set tells apart share a class
+    int classrep[RE_SYMS];
+    int nclasses;
+    struct restate* fwd;
+    int nfwd;
+    struct restate* rev;
+    int nrev;
+    struct redfa dfa[FEMTO_FIND_THREADS + 1]; // forward, per worker and the main thread
+    struct redfa rdfa; // backward, main thread only
+};
+
+// Matches of the current search are kept per chunk of FEMTO_FIND_CHUNK
+// rows. Worker threads claim chunks in order and publish each one whole, so
+// the finished chunks form a sorted index of matching rows that grows while
+// the prompt stays responsive. When the query is extended, the matches of the
+// previous query in a chunk are the only rows of it that can still match.
+struct findchunk {
+    int* rows; // matching rows, ascending
+    int n;
+    int cap;
+    int done; // published: rows and n no longer change
+};
+
+struct findstate {
+    char* query; // query being searched for, or NULL
+    struct regex* re; // query compiled, when it is a regex
+    struct findchunk* chunks;
+    struct findchunk* prev; // chunks of the query this one extends, or NULL
+    int nchunks;
+    int next; // next chunk to hand to a worker
+    int done; // finished chunks
+    int matches; // matches in finished chunks
+    int busy; // workers inside a chunk
+    int current; // row of the match the cursor is on, or -1
+    int pending; // direction of a step waiting for chunks still searched, or 0
+    int regex; // queries typed at the prompt are regexes, toggled by Ctrl-R
+    int bad; // the query is not a valid regex
+    struct regex* recache[FEMTO_RE_CACHE]; // most recently used first
+    int nthreads;
+    pthread_t threads[FEMTO_FIND_THREADS];
+    pthread_mutex_t lock; // guards everything above but the chunk contents
+    pthread_cond_t work; // chunks are waiting to be claimed
+    pthread_cond_t idle; // a worker finished its chunk
+};
+
+// A save runs on a writer thread from a snapshot of the buffer: an iovec
+// list over the file mapping and the chars of the other rows, taken without
+// copying text. Those chars are frozen until the save is over: a row about to
+// change or be freed first gets a copy of its own, and the frozen buffer is
+// freed when the save finishes.
+struct saveextent { // a run of the file mapping and where it lands in the new file
+    const char* view;
+    size_t len;
+    size_t off;
+};
+
+struct rowblock {
+    char* p;
+    size_t size;
+};
+
+struct savejob {
+    struct iovec* iov;
+    int niov;
+    size_t len; // bytes to write
+    struct saveextent* extents; // in mapping order
+    int nextents;
+    char** frozen; // chars the save writes from, open addressing
+    size_t frozencap;
+    struct rowblock* detached; // frozen chars no row uses any more
+    int ndetached;
+    int detachedcap;
+    int* packed; // iov entries that are packed leaves, unpacked as they are written
+    int npacked;
+    int modif; // E.sincemodif when the snapshot was taken
+    char* path;
+    char* tmp;
+    struct timespec start;
+    pthread_t thread;
+    pthread_mutex_t lock; // guards the fields below
+    size_t written;
+    int done;
+    int err;
+    int fd; // the new file, once renamed into place
+};
+
+// A mapped file is indexed on a loader thread, which finds the lines and
+// hands them over in chunks; the main thread adds each chunk's rows to the
+// tree between keys. Chunks start small so the first screenful shows at
+// once. Until the last one is in, moving and searching work on the rows so
+// far but edits are refused.
+#define FEMTO_LOAD_FIRST 256 // lines in the first chunk, doubling up to the next
+#define FEMTO_LOAD_CHUNK 65536 // lines in a chunk
+#define FEMTO_LOAD_AHEAD 8 // chunks the loader may get ahead of the main thread
+
+struct loadline {
+    const char* view;
+    int size;
+};
+
+struct loadchunk {
+    struct loadchunk* next;
+    int n;
+    struct loadline line[];
+};
+
+struct loadjob {
+    const char* map;
+    size_t size;
+    size_t added; // bytes of the file the rows added so far cover
+    pthread_t thread;
+    pthread_mutex_t lock; // guards the fields below
+    pthread_cond_t ready; // a chunk was queued
+    pthread_cond_t room; // a chunk was taken
+    struct loadchunk* head; // queued chunks, oldest first
+    struct loadchunk* tail;
+    int queued;
+    int done; // the last chunk is queued
+};
+
+// Follow mode, like tail -f: what is appended to the open file is read from
+// where the last read stopped and added as rows. The descriptor is followed,
+// so a log that is rotated away keeps being read.
+#define FEMTO_FOLLOW_CHUNK (1 << 20) // bytes read from a followed file at a time
+#define FEMTO_FOLLOW_MAX (16 << 20) // most bytes taken in before the next frame
+#define FEMTO_FOLLOW_MS 500 // how often a followed file is checked without inotify
+
+struct follow {
+    int fd; // the open file, or -1 when not following
+    int inotify; // reports writes to the file; -1 without inotify
+    off_t off; // bytes of the file read so far
+    int partial; // the last row has not had its newline yet
+    int held; // the file ends in a \r left unread, as it may start a \r\n
+    int nomap; // the file is read rather than mapped: it may be truncated
+    int changed; // the file was written to and not read since
+    long long checked; // editorNow() when the file was last read
+    char* buf;
+};
+
+// Crash recovery: each edit is recorded in a journal next to the file,
+// .name.femto-journal, as the operation and the cursor position it was made
+// at. Records are buffered and written out together on a timer, so a key
+// costs a few bytes of memory however big the file. The journal starts with
+// the size and mtime of the file its records apply to and starts over when
+// the file is saved; on open, the records of a journal whose file is as it
+// was are offered for replay.
+#define FEMTO_JOURNAL_MS 1000 // most ms an edit waits in memory before it is written
+#define FEMTO_JOURNAL_BUF (1 << 20) // buffered bytes that are written out at once
+#define FEMTO_JOURNAL_MAGIC "femtoj1\n"
+
+enum journalOp {
+    JOURNAL_CHAR = 1, // y x c: a typed character
+    JOURNAL_TEXT, // y x len text: pasted text, which may hold newlines
+    JOURNAL_NEWLINE, // y x: row y split at x
+    JOURNAL_DELETE, // y x: the character before x deleted, or row y joined to the one above
+    JOURNAL_ERASE // y x y2 x2: the text between erased, by an undo or redo
+};
+
+struct journalhead {
+    char magic[8];
+    int64_t size;
+    int64_t mtime; // nanoseconds
+};
+
+struct journal {
+    int fd; // the journal, or -1 when edits are not journaled
+    char* path;
+    char* buf; // records not written yet
+    size_t len;
+    size_t cap;
+    long long due; // editorNow() by which buf is written
+    off_t mark; // length of the journal when the save in progress took its snapshot
+};
+
+// Undo history: a record per edit holds where the text it inserted or
+// deleted lies, in a model where every row ends in a newline. A record only
+// keeps the text while the rows don't: an insert has none until it is undone,
+// a delete none once it is undone, so typing costs no text at all and undoing
+// a paste of any size is one erase of a range of rows. A run of typed
+// characters, or of deletes, goes into one record. Records past the budget
+// are dropped oldest first.
+#ifndef FEMTO_UNDO_BYTES
+#define FEMTO_UNDO_BYTES (64 << 20) // default memory budget of the undo history
+#endif
+
+enum undoKind {
+    UNDO_INSERT,
+    UNDO_DELETE
+};
+
+// how an insert joins the records before it
+enum undoRun {
+    UNDO_APART, // a paste: a record of its own
+    UNDO_BREAK, // a newline: starts a record typed characters join
+    UNDO_TYPED // a typed character: joins the run it continues
+};
+
+struct undorec {
+    int kind;
+    int run; // typed characters may join it
+    int y, x; // where the text starts
+    int y2, x2; // and ends, while it is in the rows
+    int eof; // the text ends the buffer, so its last row goes with it
+    char* text; // the text while it is not in the rows, or NULL
+    size_t len;
+};
+
+struct undolog {
+    struct undorec* rec; // [first, cur) can be undone, [cur, n) redone
+    int first;
+    int cur;
+    int n;
+    int cap;
+    size_t bytes; // records and their text
+    size_t budget;
+    int busy; // an undo or redo is editing the rows, which records nothing
+    int sealed; // the next edit starts a record of its own
+};
+
+// Leaves far from the screen are packed once row text takes more than the
+// budget: the text of their rows is compressed into one block and the rows
+// give up their chars, or just drop their copies if they are all still
+// views of the file. Looking a packed row up unpacks its whole leaf into one
+// of a few slots, reused least recently used first, and points the views of
+// its rows there, so drawing and searching read it like a mapped row. An
+// edit unpacks the leaf for good. Search workers and the save writer unpack
+// leaves into buffers of their own instead.
+#define FEMTO_COLD_SLOTS 32 // packed leaves kept unpacked
+#define FEMTO_COLD_NEAR 4096 // rows either side of the screen never packed
+#define FEMTO_COLD_STEP 64 // leaves looked at between two polls for keys
+#define FEMTO_LZ_HASH 13 // log2 of the codec's match table size
+#ifndef FEMTO_COLD_BYTES
+#define FEMTO_COLD_BYTES (32 << 20) // default row text kept before packing
+#endif
+
+struct coldslot {
+    rnode* leaf; // NULL if free
+    char* text;
+    size_t size;
+    unsigned long long used; // clock at the last lookup, 0 if free
+};
+
+struct coldcache {
+    struct coldslot slot[FEMTO_COLD_SLOTS];
+    unsigned long long clock;
+    int scan; // next row the packing pass looks at, or -1 between passes
+    size_t swept; // resident bytes when the last pass ended
+    size_t budget; // resident row bytes before cold leaves are packed
+    size_t packed; // bytes of the packed leaves' blocks
+    size_t raw; // and of their text
+    size_t unpacked; // text held by the slots
+};
+
 struct editorConfig {
     int cursorX;
     int cursorY;
     int rx;
-    int rowoff;
+    int ry; // screen line of the cursor while soft-wrapping
+    int rowoff; // first row on screen, or first screen line while soft-wrapping
     int coloff;
     int screenRows;
     int screenCols;
     int nrows;
-    erow* row;
+    int wrap; // long rows continue on the next screen line instead of scrolling sideways
+    rnode* root;
+    struct rowpos pos;
+    struct gapbuf gap;
+    struct rendercache render;
+    struct highlight hl;
+    struct rowmem mem;
+    int showstats; // status bar shows row memory counters, or key latency when 2
+    struct profile prof;
+    struct findstate find;
+    struct follow follow;
+    struct journal journal;
+    struct undolog undo;
+    struct coldcache cold;
+    struct savejob* save; // save in progress, or NULL
+    struct loadjob* load; // file still being loaded, or NULL
+    int wake[2]; // pipe background threads and signals write to so the screen is redrawn
+    volatile sig_atomic_t winch; // the terminal was resized
+    int woken; // the wake pipe was drained but WAKE_KEY not returned yet
+    struct inring in;
+    struct pastebuf paste;
+    int tty; // 0 when headless: keys come from editorFeed and frames are not written
+    const char* feed; // keys queued by editorFeed and not yet in the ring
+    size_t feedlen;
     int sincemodif; // tells whether file has been modified since open
     char* filename;
+    char* map; // text of the open file, shared by rows that are still views
+    size_t mapsize;
     char statusmsg[80];
-    time_t statusmsg_time;
+    long long statusmsg_time; // editorNow() when the message was set
+    int prompting; // the message is a prompt, which does not expire
+    struct frame front;
+    struct frame back;
+    int frontvalid; // front matches the terminal; cleared to force a repaint
+    int frontrowoff; // scroll offsets the front frame was drawn at
+    int frontcoloff;
+    long long lastframe; // editorNow() when the screen was last drawn
     struct termios orig_termios; // stores original attrib. of terminal before opening femto
 };
 
@@ -64,7 +668,40 @@ struct editorConfig E;
 
 /*** prototypes ***/
 void editorSetStatusMessage(const char* fmt, ...);
+int editorSaveFinish(int wait);
+void editorRowDetach(erow* row);
+int editorSaveKeep(char* p, size_t size);
+void editorFormatSize(char* buf, size_t bufsize, double bytes);
 void editorRefreshScreen();
+void editorResize();
+void editorInvalidateScreen();
+void editorHlInserted(int y);
+void editorHlDeleted(int y, int n);
+void rowNodeWidths(rnode* leaf);
+void editorWrapChanged(int y);
+void editorHlChanged(int y);
+int editorFollowDue();
+void editorFollowRead();
+int editorLoadStep(int wait);
+void editorJournalAdd(int op, int y, int x, const char* s, size_t len);
+int editorJournalDue();
+void editorJournalCommit();
+void editorJournalSaved(int fd);
+void editorUndoInserted(int y, int x, int eof, int run);
+void editorUndoDeleted(int y, int x, const char* s, size_t len);
+void editorJournalErase(int y, int x, int y2, int x2);
+struct undorec* editorUndoPush(int kind, int y, int x);
+void editorUndoTrim();
+void editorUndoAppending();
+int editorRowAscii(erow* row);
+const char* editorRowText(erow* row);
+void editorColdLoad(rnode* leaf);
+void editorColdThaw(rnode* leaf);
+void editorColdDrop(rnode* leaf);
+void editorColdCut(int at, int n);
+void editorColdMove(rnode* from, rnode* to);
+int editorColdDue();
+int editorColdStep();
 char* editorPrompt(char* prompt, void (*callback)(char *, int));
 
 /*** terminal settings/terminal input ***/
@@ -79,6 +716,7 @@ void die(const char* sh) {
 
 // Resets terminal to its original state after exiting femto
 void disableRawMode() {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
 }
 
@@ -95,74 +733,309 @@ void enableRawMode() {
     raw.c_oflag &= ~(OPOST); // output flag
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); // local flags
     raw.c_cflag |= (CS8); // sets char size to 8bits/byte
+    // reads never block: input is only read once poll says it is there
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
+
+    // bracketed paste: pasted text arrives between \x1b[200~ and \x1b[201~
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-// waits for one keypress and returns it
-int editorReadKey() {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN) die("read");
-    }
-    if (c == '\x1b') {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-        if (seq[0] == '[') {
-            if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-                if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1':
-                            return HOME_KEY;
-                        case '3':
-                            return DEL_KEY;
-                        case '4':
-                            return END_KEY;
-                        case '5':
-                            return PAGE_UP;
-                        case '6':
-                            return PAGE_DOWN;
-                        case '7':
-                            return HOME_KEY;
-                        case '8':
-                            return END_KEY;
-                    }
-                }
-            } else {
-                switch (seq[1]) {
-                    case 'A':
-                        return ARROW_UP;
-                    case 'B':
-                        return ARROW_DOWN;
-                    case 'C':
-                        return ARROW_RIGHT;
-                    case 'D':
-                        return ARROW_LEFT;
-                    case 'H':
-                        return HOME_KEY;
-                    case 'F':
-                        return END_KEY;
-                }
+// makes editorReadKey return WAKE_KEY; called from background threads
+void editorWake() {
+    write(E.wake[1], "", 1);
+}
+
+void editorHandleWinch(int sig) {
+    (void)sig;
+    int saved = errno;
+    E.winch = 1;
+    editorWake();
+    errno = saved;
+}
+
+// nanoseconds on a clock that does not jump
+long long editorNowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// the same clock in milliseconds
+long long editorNow() {
+    return editorNowNs() / 1000000;
+}
+
+// Milliseconds until the screen must be redrawn even if nothing happens,
+// or -1 if it shows nothing that changes with time. Idle means blocking
+// in poll with this timeout, so an idle editor does not wake up at all.
+int editorTimeout() {
+    long long left = -1;
+    if (E.statusmsg[0] != '\0' && !E.prompting) {
+        left = E.statusmsg_time + FEMTO_MSG_TIMEOUT - editorNow();
+        if (left <= 0) left = -1;
+    }
+    // without inotify a followed file is checked on a timer
+    if (E.follow.fd != -1 && E.follow.inotify == -1) {
+        long long check = E.follow.checked + FEMTO_FOLLOW_MS - editorNow();
+        if (check < 0) check = 0;
+        if (left == -1 || check < left) left = check;
+    }
+    if (E.journal.len) {
+        long long commit = E.journal.due - editorNow();
+        if (commit < 0) commit = 0;
+        if (left == -1 || commit < left) left = commit;
+    }
+    return (int)left;
+}
+
+// Waits up to timeout ms (-1: forever) for input and reads all that is
+// available into the ring. Returns 1 if bytes were read, 0 on timeout and -1
+// if a background thread or a followed file woke us first; the wake is then
+// kept in E.woken, or E.follow.changed, until editorReadKey acts on it.
+int editorInputFill(int timeout) {
+    struct inring* in = &E.in;
+    unsigned used = in->tail - in->head;
+    if (used == FEMTO_INPUT_SIZE) return 1;
+
+    unsigned at = in->tail & (FEMTO_INPUT_SIZE - 1);
+    unsigned room = FEMTO_INPUT_SIZE - used;
+    if (!E.tty && E.feedlen) {
+        size_t n = room < E.feedlen ? room : E.feedlen;
+        size_t first = n < FEMTO_INPUT_SIZE - at ? n : FEMTO_INPUT_SIZE - at;
+        memcpy(&in->buf[at], E.feed, first);
+        memcpy(in->buf, E.feed + first, n - first);
+        in->tail += n;
+        E.feed += n;
+        E.feedlen -= n;
+        if (E.prof.path && !E.prof.ready) E.prof.ready = editorNowNs();
+        return 1;
+    }
+    if (!E.tty && timeout == -1 && !E.find.query && !E.save && !E.load) {
+        // a headless prompt wants more keys than were fed
+        errno = ENODATA;
+        die("editorFeed");
+    }
+    if (!E.tty && timeout > 0) timeout = 0; // no more keys are coming
+
+    // background work, a signal or a followed file may wake us before a key does
+    struct pollfd fds[3] = {
+        {E.tty ? STDIN_FILENO : -1, POLLIN, 0},
+        {E.wake[0], POLLIN, 0},
+        {E.follow.inotify, POLLIN, 0},
+    };
+    int n = poll(fds, 3, timeout);
+    if (n == -1 && errno != EINTR) die("poll");
+    if (n <= 0) return 0;
+    if (fds[2].revents & POLLIN) {
+        // the events only say that the file grew; one read catches up on all
+        char buf[4096];
+        while (read(E.follow.inotify, buf, sizeof(buf)) > 0);
+        E.follow.changed = 1;
+    }
+    if (!(fds[0].revents & (POLLIN | POLLHUP))) {
+        if (fds[1].revents & POLLIN) {
+            char buf[64];
+            while (read(E.wake[0], buf, sizeof(buf)) > 0);
+            E.woken = 1;
+        }
+        return -1;
+    }
+
+    // the free space may wrap around the end of the ring
+    struct iovec iov[2];
+    iov[0].iov_base = &in->buf[at];
+    iov[0].iov_len = room < FEMTO_INPUT_SIZE - at ? room : FEMTO_INPUT_SIZE - at;
+    iov[1].iov_base = in->buf;
+    iov[1].iov_len = room - iov[0].iov_len;
+    ssize_t nread = readv(STDIN_FILENO, iov, iov[1].iov_len ? 2 : 1);
+    if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (nread <= 0) return 0;
+    in->tail += nread;
+    if (E.prof.path && !E.prof.ready) E.prof.ready = editorNowNs();
+    return 1;
+}
+
+// Returns the i-th buffered byte, waiting up to timeout ms for it to
+// arrive, or -1 if it did not.
+int editorInputPeek(unsigned i, int timeout) {
+    while (E.in.tail - E.in.head <= i) {
+        int n = editorInputFill(timeout);
+        if (n == 0) return -1;
+    }
+    return E.in.buf[(E.in.head + i) & (FEMTO_INPUT_SIZE - 1)];
+}
+
+// Collects a bracketed paste into E.paste, up to the closing \x1b[201~.
+// Plain runs are copied straight out of the ring; \r and \r\n become '\n'.
+void editorReadPaste() {
+    struct inring* in = &E.in;
+    struct pastebuf* p = &E.paste;
+    int cr = 0;
+    p->len = 0;
+    while (1) {
+        if (editorInputPeek(0, -1) == -1) continue;
+
+        unsigned at = in->head & (FEMTO_INPUT_SIZE - 1);
+        unsigned n = in->tail - in->head;
+        if (n > FEMTO_INPUT_SIZE - at) n = FEMTO_INPUT_SIZE - at;
+        const unsigned char* run = &in->buf[at];
+        const unsigned char* esc = memchr(run, '\x1b', n);
+        if (esc == run) {
+            const char* end = "\x1b[201~";
+            unsigned i = 1;
+            while (end[i] && editorInputPeek(i, -1) == end[i]) i++;
+            if (end[i] == '\0') {
+                in->head += i;
+                return;
             }
-        } else if (seq[0] == '0') {
-            switch (seq[1]) {
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
+            in->head++; // other escapes are dropped, as when typed
+            continue;
+        } else if (esc) {
+            n = esc - run;
+        }
+
+        if (p->len + n > p->cap) {
+            p->cap = p->len + n + p->cap;
+            p->text = realloc(p->text, p->cap);
+            if (p->text == NULL) die("realloc");
+        }
+        for (unsigned i = 0; i < n; i++) {
+            char c = run[i];
+            if (c == '\n' && cr) {
+                cr = 0;
+                continue;
             }
+            cr = c == '\r';
+            p->text[p->len++] = cr ? '\n' : c;
+        }
+        in->head += n;
+    }
+}
+
+// Parses the escape sequence at the head of the ring, consuming it whole
+// even when it is not one we know.
+int editorReadEscape() {
+    int c0 = editorInputPeek(1, FEMTO_ESC_TIMEOUT);
+    if (c0 == -1) {
+        E.in.head++;
+        return '\x1b';
+    }
+
+    if (c0 == 'O') {
+        int c1 = editorInputPeek(2, FEMTO_ESC_TIMEOUT);
+        E.in.head += c1 == -1 ? 2 : 3;
+        switch (c1) {
+            case 'H':
+                return HOME_KEY;
+            case 'F':
+                return END_KEY;
         }
         return '\x1b';
+    }
+    if (c0 != '[') {
+        E.in.head++;
+        return '\x1b';
+    }
+
+    // CSI: a numeric parameter, maybe modifiers after ';', then a final byte
+    int param = 0, first = 1;
+    unsigned i = 2;
+    int c;
+    while ((c = editorInputPeek(i, FEMTO_ESC_TIMEOUT)) != -1 && c >= 0x20 && c < 0x40) {
+        if (c == ';') first = 0;
+        if (first && c >= '0' && c <= '9' && param < 10000) param = param * 10 + c - '0';
+        i++;
+    }
+    E.in.head += c == -1 ? i : i + 1;
+
+    if (c == '~') {
+        switch (param) {
+            case 1:
+            case 7:
+                return HOME_KEY;
+            case 3:
+                return DEL_KEY;
+            case 4:
+            case 8:
+                return END_KEY;
+            case 5:
+                return PAGE_UP;
+            case 6:
+                return PAGE_DOWN;
+            case 200:
+                editorReadPaste();
+                return PASTE_KEY;
+        }
     } else {
-        return c;
+        switch (c) {
+            case 'A':
+                return ARROW_UP;
+            case 'B':
+                return ARROW_DOWN;
+            case 'C':
+                return ARROW_RIGHT;
+            case 'D':
+                return ARROW_LEFT;
+            case 'H':
+                return HOME_KEY;
+            case 'F':
+                return END_KEY;
+        }
+    }
+    return '\x1b';
+}
+
+// waits for one keypress and returns it
+int editorReadKey() {
+    while (E.in.head == E.in.tail) {
+        if (E.woken) {
+            E.woken = 0;
+            return WAKE_KEY;
+        }
+        if (E.winch) {
+            E.winch = 0;
+            editorResize();
+            return WAKE_KEY;
+        }
+        // a save is only finished off, and rows are only added to the end,
+        // while no search reads them
+        if (!E.find.query && editorSaveFinish(0)) return WAKE_KEY;
+        if (!E.find.query && editorLoadStep(0)) return WAKE_KEY;
+        if (!E.find.query && editorFollowDue()) {
+            editorFollowRead();
+            return WAKE_KEY;
+        }
+        if (editorJournalDue()) editorJournalCommit();
+        // cold rows are packed a few leaves at a time while no key is waiting;
+        // the counters are redrawn once a pass is over
+        if (editorColdDue()) {
+            if (editorColdStep()) return WAKE_KEY;
+            editorInputFill(0);
+            continue;
+        }
+        // wakes and resizes are reported above, a timer that ran out here
+        if (editorInputFill(editorTimeout()) == 0 && !E.winch) return WAKE_KEY;
     }
+    int c = E.in.buf[E.in.head & (FEMTO_INPUT_SIZE - 1)];
+    if (c == '\x1b') return editorReadEscape();
+    E.in.head++;
+    return c;
+}
+
+// Tells whether another key is ready, so the caller can apply it before
+// drawing. With a frame cap, keys arriving before the next frame is due
+// are waited for and folded into the same frame.
+int editorInputPending() {
+    if (E.in.head != E.in.tail) return 1;
+    int wait = 0;
+    if (FEMTO_FRAME_MS > 0) {
+        long long left = E.lastframe + FEMTO_FRAME_MS - editorNow();
+        if (left > 0) wait = left;
+    }
+    return editorInputFill(wait) == 1 && E.in.head != E.in.tail;
 }
 
 int getCursorPosition(int* rows, int* cols) {
@@ -172,6 +1045,8 @@ int getCursorPosition(int* rows, int* cols) {
     if (write(STDOUT_FILENO, "\x1b[6n", 4) != 4) return -1;
 
     while (i < sizeof(buf) - 1) {
+        struct pollfd fd = {STDOUT_FILENO, POLLIN, 0};
+        if (poll(&fd, 1, FEMTO_ESC_TIMEOUT) != 1) break;
         if (read(STDOUT_FILENO, &buf[i], 1) != 1) break;
         if (buf[i] == 'R') break;
         i++;
@@ -197,270 +1072,3894 @@ int getWindowSize(int* rows, int* cols) {
     }
 }
 
-/*** row operations ***/
-int editorRowCxToRx(erow* row, int cx) {
-    int rx = 0;
-    for (int j = 0; j < cx; j++) {
-        // if its a tab character calculate the different rx appropriately
-        if (row->chars[j] == '\t') {
-            rx += (FEMTO_TAB_STOP - 1) - (rx % FEMTO_TAB_STOP);
+/*** row memory ***/
+char* rowMemChunk(size_t size) {
+    char* chunk = malloc(size);
+    if (chunk == NULL) die("malloc");
+    E.mem.chunkbytes += size;
+    E.mem.mallocs++;
+    return chunk;
+}
+
+// returns a block of at least size bytes; free it with the same size
+char* rowMemAlloc(size_t size) {
+    if (size > FEMTO_MEM_SMALL) {
+        char* p = malloc(size);
+        if (p == NULL) die("malloc");
+        E.mem.largebytes += size;
+        E.mem.mallocs++;
+        return p;
+    }
+
+    int cls = (size + FEMTO_MEM_ALIGN - 1) / FEMTO_MEM_ALIGN;
+    size_t cap = cls * FEMTO_MEM_ALIGN;
+    char* p;
+    if (E.mem.freelist[cls]) {
+        p = E.mem.freelist[cls];
+        memcpy(&E.mem.freelist[cls], p, sizeof(void*));
+        E.mem.freebytes -= cap;
+    } else if (E.mem.bulk) {
+        if (E.mem.arenaleft < cap) {
+            E.mem.arena = rowMemChunk(FEMTO_ARENA_SIZE);
+            E.mem.arenaleft = FEMTO_ARENA_SIZE;
+        }
+        p = E.mem.arena;
+        E.mem.arena += cap;
+        E.mem.arenaleft -= cap;
+    } else {
+        if (E.mem.slableft[cls] < cap) {
+            E.mem.slab[cls] = rowMemChunk(FEMTO_SLAB_SIZE);
+            E.mem.slableft[cls] = FEMTO_SLAB_SIZE;
         }
-        rx++;
+        p = E.mem.slab[cls];
+        E.mem.slab[cls] += cap;
+        E.mem.slableft[cls] -= cap;
     }
-    return rx;
+    E.mem.livebytes += cap;
+    return p;
 }
 
-int editorRowRxToCx(erow* row, int rx) {
-    int cur_rx = 0, i;
-    for (i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') {
-            cur_rx += (FEMTO_TAB_STOP - 1) - (cur_rx % FEMTO_TAB_STOP);
-        }
-        cur_rx++;
+void rowMemFree(char* p, size_t size) {
+    if (p == NULL) return;
+    if (size > FEMTO_MEM_SMALL) {
+        free(p);
+        E.mem.largebytes -= size;
+        return;
+    }
+    int cls = (size + FEMTO_MEM_ALIGN - 1) / FEMTO_MEM_ALIGN;
+    memcpy(p, &E.mem.freelist[cls], sizeof(void*));
+    E.mem.freelist[cls] = p;
+    E.mem.livebytes -= cls * FEMTO_MEM_ALIGN;
+    E.mem.freebytes += cls * FEMTO_MEM_ALIGN;
+}
 
-        if (cur_rx > rx) return i;
+char* rowMemRealloc(char* p, size_t oldsize, size_t size) {
+    if (p == NULL) return rowMemAlloc(size);
+    if (oldsize > FEMTO_MEM_SMALL && size > FEMTO_MEM_SMALL) {
+        char* q = realloc(p, size);
+        if (q == NULL) die("realloc");
+        E.mem.largebytes += size - oldsize;
+        return q;
     }
-    return i;
+    int same = oldsize <= FEMTO_MEM_SMALL && size <= FEMTO_MEM_SMALL &&
+        (oldsize + FEMTO_MEM_ALIGN - 1) / FEMTO_MEM_ALIGN ==
+        (size + FEMTO_MEM_ALIGN - 1) / FEMTO_MEM_ALIGN;
+    if (same) return p;
+
+    char* q = rowMemAlloc(size);
+    memcpy(q, p, oldsize < size ? oldsize : size);
+    rowMemFree(p, oldsize);
+    return q;
 }
 
-void editorUpdateRow(erow* row) {
-    int tabs = 0;
+/*** utf-8 ***/
+// Whether n bytes from i on are all ASCII, a word at a time.
+int utf8AsciiScalar(const char* s, size_t n, size_t i) {
+    for (; i + 8 <= n; i += 8) {
+        uint64_t w;
+        memcpy(&w, &s[i], 8);
+        if (w & 0x8080808080808080ULL) return 0;
+    }
+    for (; i < n; i++) {
+        if (s[i] & 0x80) return 0;
+    }
+    return 1;
+}
 
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') tabs++;
+#ifdef FEMTO_X86
+// any byte with its top bit set shows up in the movemask
+__attribute__((target("avx2")))
+int utf8AsciiAvx2(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&s[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&s[i + 32]);
+        if (_mm256_movemask_epi8(_mm256_or_si256(a, b))) return 0;
     }
+    return utf8AsciiScalar(s, n, i);
+}
 
-    free(row->render);
-    row->render = malloc(row->size + 1 + tabs*(FEMTO_TAB_STOP));
+__attribute__((target("sse2")))
+int utf8AsciiSse2(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&s[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&s[i + 16]);
+        if (_mm_movemask_epi8(_mm_or_si128(a, b))) return 0;
+    }
+    return utf8AsciiScalar(s, n, i);
+}
+#endif
 
-    int idx = 0;
-    for (int i = 0; i < row->size; i++) {
-        if (row->chars[i] == '\t') {
-            row->render[idx++] = row->chars[i];
-            while (idx % FEMTO_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[i];
-        }
+// whether n bytes are plain ASCII, using the widest vector unit available
+int utf8Ascii(const char* s, size_t n) {
+#ifdef FEMTO_X86
+    static int avx2 = -1;
+    if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return utf8AsciiAvx2(s, n);
+    if (__builtin_cpu_supports("sse2")) return utf8AsciiSse2(s, n);
+#endif
+    return utf8AsciiScalar(s, n, 0);
+}
+
+// Decodes the character at s, of at most n bytes, into *cp and returns its
+// length. A malformed or cut off sequence is one byte long, with *cp -1.
+int utf8Decode(const char* s, int n, int* cp) {
+    const unsigned char* u = (const unsigned char*)s;
+    int len = u[0] < 0x80 ? 1 : u[0] < 0xc2 ? 0 : u[0] < 0xe0 ? 2 : u[0] < 0xf0 ? 3 : u[0] < 0xf5 ? 4 : 0;
+    *cp = -1;
+    if (len == 0 || len > n) return 1;
+    int c = len == 1 ? u[0] : u[0] & (0x7f >> len);
+    for (int i = 1; i < len; i++) {
+        if ((u[i] & 0xc0) != 0x80) return 1;
+        c = c << 6 | (u[i] & 0x3f);
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    // overlong forms and surrogates
+    if ((len == 3 && (c < 0x800 || (c >= 0xd800 && c < 0xe000))) || (len == 4 && (c < 0x10000 || c > 0x10ffff))) {
+        return 1;
+    }
+    *cp = c;
+    return len;
 }
 
-void editorInsertRow(int at, char* s, size_t len) {
-    if (at < 0 || at > E.nrows) return;
+// Columns a character takes: 0 for combining marks and other zero-width
+// characters, which join the one before them, 2 for East Asian wide ones.
+int utf8Width(int cp) {
+    static const int zero[][2] = {
+        {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+        {0x064b, 0x065f}, {0x0e31, 0x0e31}, {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e},
+        {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x20d0, 0x20ff},
+        {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xe0100, 0xe01ef},
+    };
+    static const int wide[][2] = {
+        {0x1100, 0x115f}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf},
+        {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xac00, 0xd7a3}, {0xf900, 0xfaff},
+        {0xfe30, 0xfe4f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x1f300, 0x1f64f},
+        {0x1f900, 0x1f9ff}, {0x20000, 0x3fffd},
+    };
+    if (cp < 0x300) return 1;
+    for (size_t i = 0; i < sizeof(zero) / sizeof(zero[0]); i++) {
+        if (cp >= zero[i][0] && cp <= zero[i][1]) return 0;
+    }
+    for (size_t i = 0; i < sizeof(wide) / sizeof(wide[0]); i++) {
+        if (cp >= wide[i][0] && cp <= wide[i][1]) return 2;
+    }
+    return 1;
+}
 
-    E.row = realloc(E.row, sizeof(erow) * (E.nrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.nrows - at));
+// Length in bytes and width in columns of the grapheme cluster at s, of at
+// most n bytes: a character and the zero-width ones after it. The cursor
+// steps over clusters and each one fills a screen cell, or two when wide.
+// A malformed byte is a cluster of its own, one column wide.
+int utf8Cluster(const char* s, int n, int* width) {
+    int cp;
+    int len = utf8Decode(s, n, &cp);
+    *width = cp == -1 ? 1 : utf8Width(cp);
+    while (len < n && (unsigned char)s[len] >= 0x80) {
+        int next = utf8Decode(&s[len], n - len, &cp);
+        if (cp == -1 || utf8Width(cp) != 0) break;
+        len += next;
+    }
+    return len;
+}
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    editorUpdateRow(&E.row[at]);
+/*** gap buffer ***/
+// moves the text after the gap back so the gapped row is contiguous again
+void editorGapClose() {
+    if (E.gap.chars == NULL) return;
+    memmove(&E.gap.chars[E.gap.at], &E.gap.chars[E.gap.at + E.gap.len], E.gap.tail);
+    E.gap.chars = NULL;
+}
 
-    E.nrows++;
-    E.sincemodif++;
+// shrinks the chars of a row whose gap was just closed back to the size
+// rowMemFree expects for it
+void editorGapTrim(erow* row, int chars) {
+    row->chars = rowMemRealloc(row->chars, chars, row->size + 1);
 }
 
-void editorFreeRow(erow* row) {
-    free(row->render);
-    free(row->chars);
+// contiguous, NUL terminated chars of a materialized row
+char* editorRowChars(erow* row) {
+    if (row->chars == E.gap.chars && row->chars) {
+        int chars = E.gap.at + E.gap.len + E.gap.tail;
+        editorGapClose();
+        editorGapTrim(row, chars);
+    }
+    return row->chars;
 }
 
-void editorDelRow(int at) {
-    if (at < 0 || at >= E.nrows) return;
-    editorFreeRow(&E.row[at]);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.nrows - at - 1));
-    E.nrows--;
-    E.sincemodif++;
+// Makes row the gapped row with at least need bytes of gap at `at`. The gap
+// grows geometrically so a run of insertions costs amortized O(1).
+void editorGapMove(erow* row, int at, int need) {
+    if (row->chars == NULL || row->chars != E.gap.chars) {
+        editorGapClose();
+        editorRowDetach(row);
+        int len = FEMTO_GAP_MIN + row->size / 8;
+        row->chars = rowMemRealloc(row->chars, row->size + 1, row->size + 1 + len);
+        memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+        E.gap.chars = row->chars;
+        E.gap.at = at;
+        E.gap.len = len;
+        E.gap.tail = row->size - at + 1;
+    } else if (at < E.gap.at) {
+        memmove(&row->chars[at + E.gap.len], &row->chars[at], E.gap.at - at);
+        E.gap.tail += E.gap.at - at;
+        E.gap.at = at;
+    } else if (at > E.gap.at) {
+        memmove(&row->chars[E.gap.at], &row->chars[E.gap.at + E.gap.len], at - E.gap.at);
+        E.gap.tail -= at - E.gap.at;
+        E.gap.at = at;
+    }
+
+    if (E.gap.len < need) {
+        int len = E.gap.len + row->size + need;
+        row->chars = rowMemRealloc(row->chars, at + E.gap.len + E.gap.tail,
+                at + len + E.gap.tail);
+        memmove(&row->chars[at + len], &row->chars[at + E.gap.len], E.gap.tail);
+        E.gap.chars = row->chars;
+        E.gap.len = len;
+    }
 }
 
-void editorRowInsertChar(erow* row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.sincemodif++;
+// Patches the cached render s of the gapped row after the character at cx
+// was inserted (ins) or a character of width oldw at cx was deleted; rx is
+// the render column of cx. Everything up to the next tab shifts by the width
+// change; if that tab absorbs the shift nothing after it moves, otherwise
+// the rest of render is moved once.
+void editorGapPatchRender(erow* row, struct renderslot* s, int cx, int rx, int ins, int oldw) {
+    int neww = 0;
+    if (ins) neww = row->chars[cx] == '\t' ? FEMTO_TAB_STOP - rx % FEMTO_TAB_STOP : 1;
+
+    // the text after the edit starts right after the gap
+    const char* p = &row->chars[E.gap.at + E.gap.len];
+    int n = row->size - E.gap.at;
+    const char* tab = memchr(p, '\t', n);
+    int plain = tab ? tab - p : n;
+
+    int nrx = rx + neww + plain; // new and old render column after the plain run
+    int orx = rx + oldw + plain;
+    int nend = nrx, oend = orx;
+    if (tab) {
+        nend += FEMTO_TAB_STOP - nrx % FEMTO_TAB_STOP;
+        oend += FEMTO_TAB_STOP - orx % FEMTO_TAB_STOP;
+    }
+
+    int rsize = s->rsize + nend - oend;
+    if (rsize + 1 > s->cap) {
+        int cap = rsize + 1 + s->cap;
+        s->render = rowMemRealloc(s->render, s->cap, cap);
+        s->cap = cap;
+    }
+    memmove(&s->render[nend], &s->render[oend], s->rsize - oend + 1);
+    s->rsize = rsize;
+
+    char* r = &s->render[rx];
+    if (ins && row->chars[cx] != '\t') {
+        *r++ = row->chars[cx];
+    } else {
+        memset(r, ' ', neww);
+        r += neww;
+    }
+    memcpy(r, p, plain);
+    memset(r + plain, ' ', nend - nrx);
+    s->hlok = 0;
 }
 
-void editorRowAppendString(erow* row, char* s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.sincemodif++;
+/*** render cache ***/
+void renderUnlink(struct rendercache* rc, int i) {
+    struct renderslot* s = &rc->slot[i];
+    if (s->prev >= 0) rc->slot[s->prev].next = s->next;
+    else rc->head = s->next;
+    if (s->next >= 0) rc->slot[s->next].prev = s->prev;
+    else rc->tail = s->prev;
+}
+
+void renderPushFront(struct rendercache* rc, int i) {
+    struct renderslot* s = &rc->slot[i];
+    s->prev = -1;
+    s->next = rc->head;
+    if (rc->head >= 0) rc->slot[rc->head].prev = i;
+    else rc->tail = i;
+    rc->head = i;
+}
+
+// makes room for at least n rendered rows
+void editorRenderReserve(int n) {
+    struct rendercache* rc = &E.render;
+    if (n <= rc->n) return;
+    rc->slot = realloc(rc->slot, n * sizeof(struct renderslot));
+    if (rc->slot == NULL) die("realloc");
+    for (int i = rc->n; i < n; i++) {
+        struct renderslot* s = &rc->slot[i];
+        s->render = NULL;
+        s->rsize = 0;
+        s->cap = 0;
+        s->stamp = 0;
+        s->hl = NULL;
+        s->hlcap = 0;
+        s->hlok = 0;
+        // unused slots go to the back, to be taken first
+        s->next = -1;
+        s->prev = rc->tail;
+        if (rc->tail >= 0) rc->slot[rc->tail].next = i;
+        else rc->head = i;
+        rc->tail = i;
+    }
+    rc->n = n;
+}
+
+// the slot holding the render of row, or NULL if it has to be rebuilt
+struct renderslot* editorRowCached(erow* row) {
+    if (row->rstamp == 0) return NULL;
+    struct renderslot* s = &E.render.slot[row->rslot];
+    return s->stamp == row->rstamp ? s : NULL;
+}
+
+// Returns row tab-expanded, building it in the least recently drawn slot if
+// it is not cached. In a plain ASCII row every render byte is one screen
+// cell; otherwise the render is UTF-8 and tabs stop at screen columns. View
+// rows are rendered straight from the mapping without being materialized.
+struct renderslot* editorRowRender(erow* row) {
+    struct rendercache* rc = &E.render;
+    struct renderslot* s = editorRowCached(row);
+    int i = s ? row->rslot : rc->tail;
+    renderUnlink(rc, i);
+    renderPushFront(rc, i);
+    if (s) return s;
+
+    s = &rc->slot[i];
+    int ascii = editorRowAscii(row);
+    const char* text = row->chars ? row->chars : row->view;
+    // skips over the gap if this is the row being typed into
+    int gapat = row->size, gaplen = 0;
+    if (!ascii) {
+        text = editorRowText(row);
+    } else if (row->chars && row->chars == E.gap.chars) {
+        gapat = E.gap.at;
+        gaplen = E.gap.len;
+    }
+
+    int rsize = 0, col = 0;
+    for (int j = 0; j < row->size;) {
+        char c = text[j < gapat ? j : j + gaplen];
+        int len = 1, w = 1;
+        if (c == '\t') {
+            w = FEMTO_TAB_STOP - col % FEMTO_TAB_STOP;
+            rsize += w;
+        } else {
+            if (!ascii) len = utf8Cluster(&text[j], row->size - j, &w);
+            rsize += len;
+        }
+        col += w;
+        j += len;
+    }
+    if (rsize + 1 > s->cap) {
+        s->render = rowMemRealloc(s->render, s->cap, rsize + 1);
+        s->cap = rsize + 1;
+    }
+
+    int idx = 0;
+    if (ascii) {
+        for (int j = 0; j < row->size; j++) {
+            char c = text[j < gapat ? j : j + gaplen];
+            if (c == '\t') {
+                // tabs are expanded to spaces so every render byte is one screen cell
+                s->render[idx++] = ' ';
+                while (idx % FEMTO_TAB_STOP != 0) s->render[idx++] = ' ';
+            } else {
+                s->render[idx++] = c;
+            }
+        }
+    } else {
+        col = 0;
+        for (int j = 0; j < row->size;) {
+            int len = 1, w;
+            if (text[j] == '\t') {
+                w = FEMTO_TAB_STOP - col % FEMTO_TAB_STOP;
+                memset(&s->render[idx], ' ', w);
+                idx += w;
+            } else {
+                len = utf8Cluster(&text[j], row->size - j, &w);
+                memcpy(&s->render[idx], &text[j], len);
+                idx += len;
+            }
+            col += w;
+            j += len;
+        }
+    }
+    s->render[idx] = '\0';
+    s->rsize = idx;
+    s->hlok = 0;
+
+    s->stamp = ++rc->stamp;
+    row->rstamp = s->stamp;
+    row->rslot = i;
+    return s;
+}
+
+/*** row storage ***/
+rnode* rowNodeNew(int leaf) {
+    rnode* node = calloc(1, sizeof(rnode));
+    if (node == NULL) die("calloc");
+    node->leaf = leaf;
+    E.mem.treebytes += sizeof(rnode);
+    if (leaf) {
+        node->rows = malloc(sizeof(erow) * FEMTO_LEAF_ROWS);
+        if (node->rows == NULL) die("malloc");
+        E.mem.treebytes += sizeof(erow) * FEMTO_LEAF_ROWS;
+        if (E.wrap) rowNodeWidths(node);
+    }
+    return node;
+}
+
+void rowNodeWidths(rnode* leaf) {
+    leaf->widths = malloc(sizeof(int) * FEMTO_LEAF_ROWS);
+    if (leaf->widths == NULL) die("malloc");
+    E.mem.treebytes += sizeof(int) * FEMTO_LEAF_ROWS;
+}
+
+void rowNodeFree(rnode* node) {
+    if (node->packed) editorColdDrop(node);
+    E.mem.treebytes -= sizeof(rnode) + (node->leaf ? sizeof(erow) * FEMTO_LEAF_ROWS : 0);
+    if (node->widths) E.mem.treebytes -= sizeof(int) * FEMTO_LEAF_ROWS;
+    free(node->widths);
+    free(node->rows);
+    free(node);
+}
+
+// screen lines of a row of the given render width while soft-wrapping; the
+// cursor at the end of a full line goes on the next one
+int rowWrapLines(int width) {
+    return width / E.screenCols + 1;
+}
+
+// index of node among its parent's children
+int rowNodeSlot(rnode* node) {
+    int i = 0;
+    while (node->parent->kids[i] != node) i++;
+    return i;
+}
+
+// finds the leaf holding row `at`; at == E.nrows yields the last leaf
+rnode* rowTreeFind(int at, int* first) {
+    rnode* node = E.root;
+    int base = 0;
+    if (at == node->nrows) { // appending, e.g. while loading a file
+        while (!node->leaf) node = node->kids[node->n - 1];
+        *first = at - node->n;
+        return node;
+    }
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n - 1 && at - base >= node->kids[i]->nrows) {
+            base += node->kids[i]->nrows;
+            i++;
+        }
+        node = node->kids[i];
+    }
+    *first = base;
+    return node;
+}
+
+// returns row `at`, stepping from the previous lookup when it is adjacent
+erow* editorRowSeek(struct rowpos* pos, int at) {
+    rnode* leaf = pos->leaf;
+    if (leaf) {
+        if (at >= pos->first + leaf->n && leaf->next &&
+                at < pos->first + leaf->n + leaf->next->n) {
+            pos->first += leaf->n;
+            leaf = leaf->next;
+        } else if (at < pos->first && leaf->prev &&
+                at >= pos->first - leaf->prev->n) {
+            leaf = leaf->prev;
+            pos->first -= leaf->n;
+        }
+    }
+    if (leaf == NULL || at < pos->first || at >= pos->first + leaf->n) {
+        leaf = rowTreeFind(at, &pos->first);
+    }
+    pos->leaf = leaf;
+    // the editor's own lookups unpack packed rows; search workers and saving
+    // walk the rows with a rowpos of their own and unpack leaves themselves
+    if (leaf->packed && pos == &E.pos) editorColdLoad(leaf);
+    return &leaf->rows[at - pos->first];
+}
+
+void editorUpdateRow(erow* row);
+
+// copies a row out of the file mapping the first time it is displayed or
+// edited; until then it costs no memory beyond its erow. The view stays so
+// that search workers can keep reading the row while it is materialized.
+void editorRowMaterialize(erow* row) {
+    if (row->chars) return;
+    row->chars = rowMemAlloc(row->size + 1);
+    memcpy(row->chars, row->view, row->size);
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+}
+
+// a row to edit; its leaf is unpacked for good if it was packed
+erow* editorRowAt(int at) {
+    erow* row = editorRowSeek(&E.pos, at);
+    editorColdThaw(E.pos.leaf);
+    if (row->chars == NULL) editorRowMaterialize(row);
+    return row;
+}
+
+// text of a row without materializing it
+const char* editorRowText(erow* row) {
+    return row->chars ? editorRowChars(row) : row->view;
+}
+
+void rowTreeAdjust(rnode* node, int rows, int lines) {
+    for (; node; node = node->parent) {
+        node->nrows += rows;
+        node->nlines += lines;
+    }
+}
+
+// Recounts the screen lines of a subtree from the row widths, when
+// soft-wrap starts or the screen width changes.
+int rowTreeCount(rnode* node) {
+    node->nlines = 0;
+    for (int i = 0; i < node->n; i++) {
+        node->nlines += node->leaf ? rowWrapLines(node->widths[i]) : rowTreeCount(node->kids[i]);
+    }
+    return node->nlines;
+}
+
+// The row on screen line `line` while soft-wrapping, with the line within
+// the row in *sub. Lines past the end give E.nrows.
+int rowTreeFindLine(int line, int* sub) {
+    rnode* node = E.root;
+    if (line >= node->nlines) {
+        *sub = line - node->nlines;
+        return E.nrows;
+    }
+    int at = 0;
+    while (!node->leaf) {
+        int i = 0;
+        while (i < node->n - 1 && line >= node->kids[i]->nlines) {
+            line -= node->kids[i]->nlines;
+            at += node->kids[i]->nrows;
+            i++;
+        }
+        node = node->kids[i];
+    }
+    int i = 0;
+    while (i < node->n - 1 && line >= rowWrapLines(node->widths[i])) {
+        line -= rowWrapLines(node->widths[i]);
+        i++;
+    }
+    *sub = line;
+    return at + i;
+}
+
+// the first screen line of row `at` while soft-wrapping
+int rowTreeLine(int at) {
+    if (at >= E.nrows) return E.root->nlines;
+    int first;
+    rnode* node = rowTreeFind(at, &first);
+    int line = 0;
+    for (int i = 0; i < at - first; i++) line += rowWrapLines(node->widths[i]);
+    for (; node->parent; node = node->parent) {
+        int slot = rowNodeSlot(node);
+        for (int i = 0; i < slot; i++) line += node->parent->kids[i]->nlines;
+    }
+    return line;
+}
+
+// the render width row `at` was last measured at
+int rowTreeWidth(int at) {
+    editorRowSeek(&E.pos, at);
+    return E.pos.leaf->widths[at - E.pos.first];
+}
+
+void rowTreeSetWidth(int at, int width) {
+    int first;
+    rnode* leaf = rowTreeFind(at, &first);
+    int* w = &leaf->widths[at - first];
+    rowTreeAdjust(leaf, 0, rowWrapLines(width) - rowWrapLines(*w));
+    *w = width;
+}
+
+// Splits a full node after its first `half` entries and hooks the right part
+// into the parent. Appending splits off just the last entry so that loading
+// or pasting lines in order leaves nodes nearly full instead of half empty.
+rnode* rowNodeSplit(rnode* node, int half) {
+    if (node->parent == NULL) {
+        rnode* root = rowNodeNew(0);
+        root->n = 1;
+        root->nrows = node->nrows;
+        root->nlines = node->nlines;
+        root->kids[0] = node;
+        node->parent = root;
+        E.root = root;
+    } else if (node->parent->n == FEMTO_NODE_KIDS) {
+        int last = rowNodeSlot(node) == FEMTO_NODE_KIDS - 1;
+        rowNodeSplit(node->parent, last ? FEMTO_NODE_KIDS - 1 : FEMTO_NODE_KIDS / 2);
+    }
+    rnode* parent = node->parent;
+    rnode* right = rowNodeNew(node->leaf);
+
+    right->n = node->n - half;
+    if (node->leaf) {
+        memcpy(right->rows, &node->rows[half], sizeof(erow) * right->n);
+        right->nrows = right->n;
+        if (node->widths) {
+            memcpy(right->widths, &node->widths[half], sizeof(int) * right->n);
+            for (int i = 0; i < right->n; i++) right->nlines += rowWrapLines(right->widths[i]);
+        }
+        right->prev = node;
+        right->next = node->next;
+        if (node->next) node->next->prev = right;
+        node->next = right;
+    } else {
+        for (int i = 0; i < right->n; i++) {
+            right->kids[i] = node->kids[half + i];
+            right->kids[i]->parent = right;
+            right->nrows += right->kids[i]->nrows;
+            right->nlines += right->kids[i]->nlines;
+        }
+    }
+    node->n = half;
+    node->nrows -= right->nrows;
+    node->nlines -= right->nlines;
+
+    int slot = rowNodeSlot(node);
+    memmove(&parent->kids[slot + 2], &parent->kids[slot + 1],
+            sizeof(rnode*) * (parent->n - slot - 1));
+    parent->kids[slot + 1] = right;
+    parent->n++;
+    right->parent = parent;
+    return right;
+}
+
+// folds an underfull node into a sibling and collapses a single-child root
+void rowNodeRebalance(rnode* node) {
+    rnode* parent = node->parent;
+    if (parent == NULL) {
+        while (!E.root->leaf && E.root->n == 1) {
+            rnode* old = E.root;
+            E.root = old->kids[0];
+            E.root->parent = NULL;
+            rowNodeFree(old);
+        }
+        return;
+    }
+
+    int cap = node->leaf ? FEMTO_LEAF_ROWS : FEMTO_NODE_KIDS;
+    if (node->n >= cap / 4 || parent->n == 1) return;
+
+    int slot = rowNodeSlot(node);
+    rnode* left = slot > 0 ? parent->kids[slot - 1] : node;
+    rnode* right = slot > 0 ? node : parent->kids[1];
+    if (left->n + right->n > cap) return;
+    // a packed leaf is not unpacked to be merged, since its rows may be
+    // about to be deleted, but moves whole into an empty one
+    if (left->leaf && left->n && right->n && (left->packed || right->packed)) return;
+
+    if (left->leaf) {
+        if (right->packed) editorColdMove(right, left);
+        memcpy(&left->rows[left->n], right->rows, sizeof(erow) * right->n);
+        if (left->widths) memcpy(&left->widths[left->n], right->widths, sizeof(int) * right->n);
+        left->next = right->next;
+        if (right->next) right->next->prev = left;
+    } else {
+        for (int i = 0; i < right->n; i++) {
+            left->kids[left->n + i] = right->kids[i];
+            right->kids[i]->parent = left;
+        }
+    }
+    left->n += right->n;
+    left->nrows += right->nrows;
+    left->nlines += right->nlines;
+
+    slot = rowNodeSlot(right);
+    memmove(&parent->kids[slot], &parent->kids[slot + 1],
+            sizeof(rnode*) * (parent->n - slot - 1));
+    parent->n--;
+    rowNodeFree(right);
+    rowNodeRebalance(parent);
+}
+
+// opens an uninitialised slot for row `at` and returns it
+erow* rowTreeInsert(int at) {
+    int first;
+    rnode* leaf = rowTreeFind(at, &first);
+    editorColdThaw(leaf);
+    if (leaf->n == FEMTO_LEAF_ROWS) {
+        int append = at - first == leaf->n;
+        rnode* right = rowNodeSplit(leaf, append ? leaf->n - 1 : leaf->n / 2);
+        if (at - first >= leaf->n) {
+            first += leaf->n;
+            leaf = right;
+        }
+    }
+    int i = at - first;
+    memmove(&leaf->rows[i + 1], &leaf->rows[i], sizeof(erow) * (leaf->n - i));
+    if (leaf->widths) {
+        // an empty row until its text is measured
+        memmove(&leaf->widths[i + 1], &leaf->widths[i], sizeof(int) * (leaf->n - i));
+        leaf->widths[i] = 0;
+    }
+    leaf->n++;
+    rowTreeAdjust(leaf, 1, E.wrap);
+    E.pos.leaf = NULL;
+    return &leaf->rows[i];
+}
+
+// Opens slots for up to n rows after the last one, all in the last leaf, and
+// returns the first; *k is how many. One lookup and one count update serve
+// the whole run, which is what makes loading a file cheap.
+erow* rowTreeAppend(int n, int* k) {
+    int first;
+    rnode* leaf = rowTreeFind(E.root->nrows, &first);
+    if (leaf->n == FEMTO_LEAF_ROWS) leaf = rowNodeSplit(leaf, leaf->n);
+    editorColdThaw(leaf);
+    *k = n < FEMTO_LEAF_ROWS - leaf->n ? n : FEMTO_LEAF_ROWS - leaf->n;
+    if (leaf->widths) memset(&leaf->widths[leaf->n], 0, sizeof(int) * *k);
+    erow* rows = &leaf->rows[leaf->n];
+    leaf->n += *k;
+    rowTreeAdjust(leaf, *k, E.wrap ? *k : 0);
+    E.pos.leaf = NULL;
+    return rows;
+}
+
+// Deletes rows [at, at + n) a leaf at a time, with one lookup, count update
+// and rebalance for the rows of each leaf.
+void rowTreeDelete(int at, int n) {
+    while (n > 0) {
+        int first;
+        rnode* leaf = rowTreeFind(at, &first);
+        int i = at - first;
+        int k = n < leaf->n - i ? n : leaf->n - i;
+        int lines = 0;
+        // editorDelRows unpacked the leaf unless all of its rows go
+        if (leaf->packed) editorColdDrop(leaf);
+        memmove(&leaf->rows[i], &leaf->rows[i + k], sizeof(erow) * (leaf->n - i - k));
+        if (leaf->widths) {
+            for (int j = i; j < i + k; j++) lines += rowWrapLines(leaf->widths[j]);
+            memmove(&leaf->widths[i], &leaf->widths[i + k], sizeof(int) * (leaf->n - i - k));
+        }
+        leaf->n -= k;
+        rowTreeAdjust(leaf, -k, -lines);
+        rowNodeRebalance(leaf);
+        n -= k;
+    }
+    E.pos.leaf = NULL;
+}
+
+/*** row operations ***/
+size_t rowTabsSize(int cap) {
+    return sizeof(struct tabindex) + cap * sizeof(struct tabstop);
+}
+
+// index of the first tab at or after column cx
+int rowTabFind(struct tabindex* t, int cx) {
+    int lo = 0, hi = t->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t->tab[mid].cx < cx) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Whether every byte of row is ASCII (tabs included), checked once with
+// utf8Ascii and remembered until the row changes. Tabs still have to be
+// expanded, so cx and rx differ on such a row if it holds one.
+int editorRowAscii(erow* row) {
+    if (row->ascii == ROW_UNCHECKED) {
+        const char* text = row->chars ? row->chars : row->view;
+        int ascii;
+        if (row->chars && row->chars == E.gap.chars) {
+            ascii = utf8Ascii(text, E.gap.at) &&
+                utf8Ascii(&text[E.gap.at + E.gap.len], row->size - E.gap.at);
+        } else {
+            ascii = utf8Ascii(text, row->size);
+        }
+        row->ascii = ascii ? ROW_ASCII : ROW_UTF8;
+    }
+    return row->ascii == ROW_ASCII;
+}
+
+// the tab index of row, extended to cover the columns before cx
+struct tabindex* editorRowTabs(erow* row, int cx) {
+    struct tabindex* t = row->tabs;
+    if (t == NULL) {
+        t = (struct tabindex*)rowMemAlloc(rowTabsSize(4));
+        t->valid = t->n = 0;
+        t->cap = 4;
+        row->tabs = t;
+    }
+    if (t->valid >= cx) return t;
+
+    int ascii = editorRowAscii(row);
+    // views are indexed without being materialized; skips over the gap if
+    // this is the row being typed into, which only ASCII rows keep
+    const char* text = row->chars ? row->chars : row->view;
+    int gapat = cx, gaplen = 0;
+    if (!ascii) {
+        text = editorRowText(row);
+    } else if (row->chars && row->chars == E.gap.chars) {
+        gapat = E.gap.at;
+        gaplen = E.gap.len;
+    }
+    int rx = t->valid;
+    if (t->n) rx = t->tab[t->n - 1].rx + t->valid - t->tab[t->n - 1].cx - t->tab[t->n - 1].len;
+    int j = t->valid;
+    while (j < cx) {
+        int len = 1, w = 1;
+        char c = text[j < gapat ? j : j + gaplen];
+        if (c == '\t') {
+            w = FEMTO_TAB_STOP - rx % FEMTO_TAB_STOP;
+        } else if (!ascii) {
+            len = utf8Cluster(&text[j], row->size - j, &w);
+        }
+        rx += w;
+        if (len != w || c == '\t') {
+            if (t->n == t->cap) {
+                t = (struct tabindex*)rowMemRealloc((char*)t, rowTabsSize(t->cap), rowTabsSize(t->cap * 2));
+                t->cap *= 2;
+                row->tabs = t;
+            }
+            t->tab[t->n].cx = j;
+            t->tab[t->n].rx = rx;
+            t->tab[t->n].len = len;
+            t->n++;
+        }
+        j += len;
+    }
+    // a character that started before cx is indexed whole
+    t->valid = j;
+    return t;
+}
+
+// Forgets what the tab index knew from column cx on, after an edit there.
+// The chars before cx must be contiguous. In a row that is not plain ASCII
+// the cut goes back to the start of the last whole character with a width
+// before cx, since a combining mark typed at cx, or the rest of a character
+// typed a byte at a time, joins the cluster it starts.
+void editorRowTabsCut(erow* row, int cx) {
+    struct tabindex* t = row->tabs;
+    if (t == NULL || t->valid < cx) return;
+    if (cx > 0 && row->ascii != ROW_ASCII) {
+        int cp;
+        do {
+            int at = cx - 1;
+            while (at > 0 && (row->chars[at] & 0xc0) == 0x80) at--;
+            utf8Decode(&row->chars[at], cx - at, &cp);
+            cx = at;
+        } while (cx > 0 && (cp == -1 || utf8Width(cp) == 0));
+    }
+    if (t->valid <= cx) return;
+    t->valid = cx;
+    t->n = rowTabFind(t, cx);
+}
+
+int editorRowCxToRx(erow* row, int cx) {
+    struct tabindex* t = editorRowTabs(row, cx);
+    int k = rowTabFind(t, cx);
+    if (k == 0) return cx;
+    return t->tab[k - 1].rx + cx - t->tab[k - 1].cx - t->tab[k - 1].len;
+}
+
+int editorRowRxToCx(erow* row, int rx) {
+    struct tabindex* t = editorRowTabs(row, row->size);
+    // the first stop that ends after rx
+    int lo = 0, hi = t->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (t->tab[mid].rx <= rx) lo = mid + 1;
+        else hi = mid;
+    }
+    int cx = rx;
+    if (lo) cx = t->tab[lo - 1].cx + t->tab[lo - 1].len + rx - t->tab[lo - 1].rx;
+    if (lo < t->n && cx > t->tab[lo].cx) cx = t->tab[lo].cx; // rx is inside that stop
+    return cx < row->size ? cx : row->size;
+}
+
+// cx moved back to the start of the cluster it is in
+int editorRowSnap(erow* row, int cx) {
+    if (cx <= 0 || editorRowAscii(row)) return cx;
+    struct tabindex* t = editorRowTabs(row, cx);
+    int k = rowTabFind(t, cx);
+    if (k && t->tab[k - 1].cx + t->tab[k - 1].len > cx) return t->tab[k - 1].cx;
+    return cx;
+}
+
+// the column of the cluster after the one at cx
+int editorRowNext(erow* row, int cx) {
+    if (editorRowAscii(row)) return cx + 1;
+    struct tabindex* t = editorRowTabs(row, cx + 1);
+    int k = rowTabFind(t, cx);
+    if (k < t->n && t->tab[k].cx == cx) return cx + t->tab[k].len;
+    return cx + 1;
+}
+
+// Soft-wrapped lines break between characters: a wide character that would
+// straddle the end of a screen line starts the next one, leaving the last
+// column of the line blank. Walks the n bytes of text laid out that way up
+// to byte cx, or to the character wrapped column rx falls in if rx >= 0, or
+// the one before if rx is such a blank column. Returns the wrapped column
+// the walk stopped at and puts its byte in *at.
+int wrapWalk(const char* s, int n, int cx, int rx, int* at) {
+    int cols = E.screenCols;
+    int raw = 0, col = 0, j = 0, prev = 0;
+    while (j < n) {
+        int len = 1, w = 1;
+        if (s[j] == '\t') w = FEMTO_TAB_STOP - raw % FEMTO_TAB_STOP;
+        else len = utf8Cluster(&s[j], n - j, &w);
+        int pad = w == 2 && s[j] != '\t' && cols > 1 && col % cols == cols - 1;
+        if (j >= cx) {
+            col += pad;
+            break;
+        }
+        if (rx >= 0 && rx < col + pad + w) {
+            if (rx < col + pad) j = prev;
+            break;
+        }
+        raw += w;
+        col += pad + w;
+        prev = j;
+        j += len;
+    }
+    *at = j;
+    return col;
+}
+
+// The width of row as soft-wrap lays it out, which is its render width
+// unless it holds wide characters. A view is measured without building a
+// tab index for it, since soft-wrap measures every row of the file.
+int editorRowWidth(erow* row) {
+    int at;
+    if (!editorRowAscii(row)) return wrapWalk(editorRowText(row), row->size, row->size, -1, &at);
+    if (row->chars || row->tabs) return editorRowCxToRx(row, row->size);
+    if (memchr(row->view, '\t', row->size) == NULL) return row->size;
+    int rx = 0;
+    for (int j = 0; j < row->size; j++) {
+        rx += row->view[j] == '\t' ? FEMTO_TAB_STOP - rx % FEMTO_TAB_STOP : 1;
+    }
+    return rx;
+}
+
+// called after the chars of row changed; its render is rebuilt when drawn
+void editorUpdateRow(erow* row) {
+    editorRowChars(row);
+    editorRowTabsCut(row, 0);
+    row->rstamp = 0;
+    row->ascii = ROW_UNCHECKED;
+}
+
+void editorInsertRow(int at, char* s, size_t len) {
+    if (at < 0 || at > E.nrows) return;
+
+    erow* row = rowTreeInsert(at);
+    row->size = len;
+    row->chars = rowMemAlloc(len + 1);
+    memcpy(row->chars, s, len);
+    row->chars[len] = '\0';
+    row->view = NULL;
+    row->tabs = NULL;
+    row->hlstate = HL_NORMAL;
+    row->ascii = ROW_UNCHECKED;
+    editorUpdateRow(row);
+    editorHlInserted(at);
+
+    E.nrows++;
+    E.sincemodif++;
+    editorWrapChanged(at);
+}
+
+// appends rows that are views of the file, a leaf at a time
+void editorAppendRowViews(const struct loadline* lines, int n) {
+    while (n > 0) {
+        int k;
+        erow* row = rowTreeAppend(n, &k);
+        for (int i = 0; i < k; i++, row++) {
+            row->size = lines[i].size;
+            row->chars = NULL;
+            row->view = lines[i].view;
+            row->tabs = NULL;
+            row->rstamp = 0;
+            row->ascii = ROW_UNCHECKED;
+            row->hlstate = HL_NORMAL;
+            editorHlInserted(E.nrows);
+            E.nrows++;
+            editorWrapChanged(E.nrows - 1);
+        }
+        lines += k;
+        n -= k;
+    }
+}
+
+void editorFreeRow(erow* row) {
+    if (row->tabs) rowMemFree((char*)row->tabs, rowTabsSize(row->tabs->cap));
+    if (row->chars == E.gap.chars && row->chars) {
+        rowMemFree(row->chars, E.gap.at + E.gap.len + E.gap.tail);
+        E.gap.chars = NULL;
+        return;
+    }
+    if (!editorSaveKeep(row->chars, row->size + 1)) rowMemFree(row->chars, row->size + 1);
+}
+
+// Deletes rows [at, at + n); rows that are still views need no freeing. The
+// rows are freed walking a rowpos of their own, so that packed leaves that go
+// whole are not unpacked on the way.
+void editorDelRows(int at, int n) {
+    if (at < 0 || n <= 0 || at + n > E.nrows) return;
+    editorColdCut(at, n);
+    struct rowpos pos = {NULL, 0};
+    for (int i = 0; i < n; i++) editorFreeRow(editorRowSeek(&pos, at + i));
+    rowTreeDelete(at, n);
+    editorHlDeleted(at, n);
+    E.nrows -= n;
+    E.sincemodif++;
+}
+
+void editorDelRow(int at) {
+    editorDelRows(at, 1);
+}
+
+// Only the render of a plain ASCII row is patched; any other is rebuilt.
+void editorRowInsertChar(erow* row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+    int ascii = editorRowAscii(row) && !(c & 0x80);
+    int rx = ascii ? editorRowCxToRx(row, at) : 0;
+    editorGapMove(row, at, 1);
+    row->chars[at] = c;
+    row->view = NULL;
+    if (!ascii) row->ascii = ROW_UTF8;
+    editorRowTabsCut(row, at);
+    E.gap.at++;
+    E.gap.len--;
+    row->size++;
+    struct renderslot* s = editorRowCached(row);
+    if (s && ascii) editorGapPatchRender(row, s, at, rx, 1, 0);
+    else row->rstamp = 0;
+    E.sincemodif++;
+}
+
+void editorRowAppendString(erow* row, char* s, size_t len) {
+    editorRowChars(row);
+    editorRowDetach(row);
+    row->chars = rowMemRealloc(row->chars, row->size + 1, row->size + len + 1);
+    memcpy(&row->chars[row->size], s, len);
+    row->view = NULL;
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(row);
+    E.sincemodif++;
+}
+
+void editorRowDelChar(erow* row, int at) {
+    if (at < 0 || at >= row->size) return;
+    int ascii = editorRowAscii(row);
+    int rx = ascii ? editorRowCxToRx(row, at) : 0;
+    editorGapMove(row, at + 1, 0);
+    int oldw = row->chars[at] == '\t' ? FEMTO_TAB_STOP - rx % FEMTO_TAB_STOP : 1;
+    row->view = NULL;
+    editorRowTabsCut(row, at);
+    // what is left may be plain ASCII again
+    if (!ascii) row->ascii = ROW_UNCHECKED;
+    E.gap.at--;
+    E.gap.len++;
+    row->size--;
+    struct renderslot* s = editorRowCached(row);
+    if (s && ascii) editorGapPatchRender(row, s, at, rx, 0, oldw);
+    else row->rstamp = 0;
+    E.sincemodif++;
+}
+
+/*** cold rows ***/
+// An LZ77 codec in the manner of LZ4: a sequence is a token byte holding a
+// literal count and a match length less 4 in its two nibbles, either
+// continued in bytes of 255 when it is 15, then the literals and a two byte
+// offset back to the match. The last sequence has literals only; the
+// decoder stops when it has produced the length it was given.
+size_t lzBound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+char* lzPutLen(char* out, size_t len) {
+    for (; len >= 255; len -= 255) *out++ = (char)255;
+    *out++ = len;
+    return out;
+}
+
+size_t lzGetLen(const unsigned char** in) {
+    size_t len = 0;
+    unsigned char b;
+    do {
+        b = *(*in)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+char* lzSequence(char* out, const char* lit, size_t nlit, size_t off, size_t len) {
+    size_t m = len ? len - 4 : 0;
+    *out++ = (nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15);
+    if (nlit >= 15) out = lzPutLen(out, nlit - 15);
+    memcpy(out, lit, nlit);
+    out += nlit;
+    if (len == 0) return out;
+    *out++ = off & 0xff;
+    *out++ = off >> 8;
+    if (m >= 15) out = lzPutLen(out, m - 15);
+    return out;
+}
+
+// compresses n bytes of in into out, which has room for lzBound(n)
+size_t lzCompress(const char* in, size_t n, char* out) {
+    int32_t table[1 << FEMTO_LZ_HASH];
+    memset(table, 0xff, sizeof(table));
+    char* o = out;
+    size_t i = 0, lit = 0;
+    while (i + 4 <= n) {
+        uint32_t v;
+        memcpy(&v, &in[i], 4);
+        uint32_t h = (v * 2654435761u) >> (32 - FEMTO_LZ_HASH);
+        int32_t at = table[h];
+        table[h] = i;
+        if (at < 0 || i - at > 65535 || memcmp(&in[at], &in[i], 4) != 0) {
+            i++;
+            continue;
+        }
+        size_t len = 4;
+        while (i + len < n && in[at + len] == in[i + len]) len++;
+        o = lzSequence(o, &in[lit], i - lit, i - at, len);
+        i += len;
+        lit = i;
+    }
+    return lzSequence(o, &in[lit], n - lit, 0, 0) - out;
+}
+
+// unpacks exactly n bytes into out
+void lzDecompress(const char* in, char* out, size_t n) {
+    const unsigned char* p = (const unsigned char*)in;
+    char* end = out + n;
+    while (1) {
+        unsigned token = *p++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) nlit += lzGetLen(&p);
+        memcpy(out, p, nlit);
+        out += nlit;
+        p += nlit;
+        if (out == end) return;
+        size_t off = p[0] | p[1] << 8;
+        p += 2;
+        size_t len = (token & 15) + 4;
+        if ((token & 15) == 15) len += lzGetLen(&p);
+        // the match may overlap what it produces
+        const char* from = out - off;
+        if (off >= len) {
+            memcpy(out, from, len);
+            out += len;
+        } else {
+            while (len--) *out++ = *from++;
+        }
+    }
+}
+
+// row bytes held uncompressed, not counting the slots
+size_t editorColdResident() {
+    return E.mem.livebytes + E.mem.largebytes - E.cold.packed;
+}
+
+void editorColdEvict(struct coldslot* s) {
+    if (s->leaf) {
+        for (int i = 0; i < s->leaf->n; i++) s->leaf->rows[i].view = NULL;
+    }
+    free(s->text);
+    E.cold.unpacked -= s->size;
+    s->leaf = NULL;
+    s->text = NULL;
+    s->size = 0;
+    s->used = 0;
+}
+
+// Unpacks leaf into a slot unless it is in one, pointing the views of its
+// rows at the text there.
+void editorColdLoad(rnode* leaf) {
+    struct coldcache* cc = &E.cold;
+    struct coldslot* s = NULL;
+    struct coldslot* lru = &cc->slot[0];
+    for (int i = 0; i < FEMTO_COLD_SLOTS && s == NULL; i++) {
+        if (cc->slot[i].leaf == leaf) s = &cc->slot[i];
+        else if (cc->slot[i].used < lru->used) lru = &cc->slot[i];
+    }
+    if (s == NULL) {
+        s = lru;
+        editorColdEvict(s);
+        s->text = malloc(leaf->rawsize);
+        if (s->text == NULL) die("malloc");
+        lzDecompress(leaf->packed, s->text, leaf->rawsize);
+        s->leaf = leaf;
+        s->size = leaf->rawsize;
+        cc->unpacked += s->size;
+        const char* p = s->text;
+        for (int i = 0; i < leaf->n; i++) {
+            leaf->rows[i].view = p;
+            p += leaf->rows[i].size + 1;
+        }
+    }
+    s->used = ++cc->clock;
+}
+
+// Forgets the block of a packed leaf whose rows are being deleted or have
+// their text back. A save in progress may still have to write it.
+void editorColdDrop(rnode* leaf) {
+    for (int i = 0; i < FEMTO_COLD_SLOTS; i++) {
+        struct coldslot* s = &E.cold.slot[i];
+        if (s->leaf != leaf) continue;
+        s->leaf = NULL; // the rows' views are left to the caller
+        editorColdEvict(s);
+    }
+    if (!editorSaveKeep(leaf->packed, leaf->packedsize)) rowMemFree(leaf->packed, leaf->packedsize);
+    E.cold.packed -= leaf->packedsize;
+    E.cold.raw -= leaf->rawsize;
+    leaf->packed = NULL;
+    leaf->packedsize = leaf->rawsize = 0;
+}
+
+// hands the block of a packed leaf to the empty leaf its rows move to
+void editorColdMove(rnode* from, rnode* to) {
+    to->packed = from->packed;
+    to->packedsize = from->packedsize;
+    to->rawsize = from->rawsize;
+    from->packed = NULL;
+    from->packedsize = from->rawsize = 0;
+    for (int i = 0; i < FEMTO_COLD_SLOTS; i++) {
+        if (E.cold.slot[i].leaf == from) E.cold.slot[i].leaf = to;
+    }
+}
+
+// gives the rows of leaf their chars back if it is packed
+void editorColdThaw(rnode* leaf) {
+    if (leaf->packed == NULL) return;
+    editorColdLoad(leaf);
+    for (int i = 0; i < leaf->n; i++) {
+        editorRowMaterialize(&leaf->rows[i]);
+        leaf->rows[i].view = NULL;
+    }
+    editorColdDrop(leaf);
+}
+
+// before rows [at, at + n) are deleted: unpacks the packed leaves at either
+// end that keep some of their rows
+void editorColdCut(int at, int n) {
+    int ends[2] = {at, at + n - 1};
+    for (int e = 0; e < 2; e++) {
+        int first;
+        rnode* leaf = rowTreeFind(ends[e], &first);
+        if (leaf->packed && (first < at || first + leaf->n > at + n)) editorColdThaw(leaf);
+    }
+}
+
+// Packs leaf unless a row of it is being typed into, or it does not
+// compress. If every row is still a view of the file the copies are dropped
+// instead; the mapping holds their text already.
+void editorColdPack(rnode* leaf) {
+    if (leaf->packed || leaf->n == 0) return;
+    size_t raw = 0;
+    int views = 1;
+    for (int i = 0; i < leaf->n; i++) {
+        erow* row = &leaf->rows[i];
+        if (row->chars && row->chars == E.gap.chars) return;
+        if (row->view == NULL) views = 0;
+        raw += row->size + 1;
+    }
+    if (raw > INT32_MAX) return; // past what the codec's table can point at
+    if (views) {
+        for (int i = 0; i < leaf->n; i++) {
+            erow* row = &leaf->rows[i];
+            if (row->chars == NULL) continue;
+            editorFreeRow(row);
+            row->chars = NULL;
+            row->tabs = NULL;
+        }
+        return;
+    }
+
+    char* text = malloc(raw);
+    char* block = malloc(lzBound(raw));
+    if (text == NULL || block == NULL) die("malloc");
+    char* p = text;
+    for (int i = 0; i < leaf->n; i++) {
+        erow* row = &leaf->rows[i];
+        memcpy(p, row->chars ? row->chars : row->view, row->size);
+        p[row->size] = '\n';
+        p += row->size + 1;
+    }
+    size_t size = lzCompress(text, raw, block);
+    free(text);
+    if (size >= raw) {
+        free(block);
+        return;
+    }
+    leaf->packed = rowMemAlloc(size);
+    memcpy(leaf->packed, block, size);
+    free(block);
+    leaf->packedsize = size;
+    leaf->rawsize = raw;
+    E.cold.packed += size;
+    E.cold.raw += raw;
+    // the rows keep their render slots and highlight states: the text is the same
+    for (int i = 0; i < leaf->n; i++) {
+        erow* row = &leaf->rows[i];
+        editorFreeRow(row);
+        row->chars = NULL;
+        row->view = NULL;
+        row->tabs = NULL;
+    }
+}
+
+// Whether a packing pass is under way or due: row text is over the budget
+// and has grown since the last pass. Rows are not packed while a search,
+// save or load may be reading them.
+int editorColdDue() {
+    if (E.find.query || E.save || E.load) return 0;
+    if (E.cold.scan >= 0) return 1;
+    size_t resident = editorColdResident();
+    if (resident < E.cold.swept) E.cold.swept = resident;
+    return resident > E.cold.budget && resident > E.cold.swept + E.cold.budget / 8;
+}
+
+// Packs the next few leaves that are far from the screen. Returns 1 when
+// the pass is over.
+int editorColdStep() {
+    int sub;
+    int top = E.wrap ? rowTreeFindLine(E.rowoff, &sub) : E.rowoff;
+    int lo = top - FEMTO_COLD_NEAR;
+    int hi = top + E.screenRows + FEMTO_COLD_NEAR;
+    if (E.cold.scan < 0) E.cold.scan = 0;
+    for (int k = 0; k < FEMTO_COLD_STEP && E.cold.scan < E.nrows; k++) {
+        int first;
+        rnode* leaf = rowTreeFind(E.cold.scan, &first);
+        if (first + leaf->n <= lo || first >= hi) editorColdPack(leaf);
+        E.cold.scan = first + leaf->n;
+    }
+    if (E.cold.scan < E.nrows) return 0;
+    E.cold.scan = -1;
+    E.cold.swept = editorColdResident();
+    return 1;
+}
+
+/*** syntax highlighting ***/
+const char* C_HL_extensions[] = {".c", ".h", ".cpp", ".hpp", ".cc", NULL};
+const char* C_HL_keywords[] = {
+    "switch", "if", "while", "for", "break", "continue", "return", "else",
+    "struct", "union", "typedef", "static", "enum", "class", "case", "default",
+    "do", "goto", "sizeof", "const", "volatile", "extern", "inline", "register",
+    "#include", "#define", "#undef", "#if", "#ifdef", "#ifndef", "#elif",
+    "#else", "#endif", "#pragma",
+    "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
+    "void|", "short|", "size_t|", "ssize_t|", "bool|", NULL
+};
+
+struct syntax HLDB[] = {
+    {"c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/"},
+};
+
+int hlIsSeparator(int c) {
+    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];{}&|!^:?", c) != NULL;
+}
+
+void hlMark(unsigned char* hl, int from, int n, unsigned char attr) {
+    if (hl) memset(&hl[from], attr, n);
+}
+
+// Lexes len bytes of a row that starts in state and returns the state it
+// ends in. With hl NULL only the state is wanted, and keywords and numbers,
+// which cannot change it, are not looked for.
+int hlLex(struct syntax* syn, const char* s, int len, int state, unsigned char* hl) {
+    int lclen = strlen(syn->linecomment);
+    int bslen = strlen(syn->blockstart);
+    int belen = strlen(syn->blockend);
+    hlMark(hl, 0, len, FEMTO_ATTR_NORMAL);
+
+    int i = 0, sep = 1;
+    while (i < len) {
+        if (state == HL_COMMENT) {
+            const char* end = memmem(&s[i], len - i, syn->blockend, belen);
+            int n = end ? end - &s[i] + belen : len - i;
+            hlMark(hl, i, n, FEMTO_ATTR_COMMENT);
+            i += n;
+            if (end) state = HL_NORMAL;
+            sep = 1;
+            continue;
+        }
+        if (state != HL_NORMAL) {
+            // inside a string that opened with the quote in state
+            while (i < len) {
+                char c = s[i];
+                int n = c == '\\' && i + 1 < len ? 2 : 1;
+                hlMark(hl, i, n, FEMTO_ATTR_STRING);
+                i += n;
+                if (c == '\\' && n == 1) return state; // continued on the next row
+                if (c == state) break;
+            }
+            state = HL_NORMAL;
+            sep = 1;
+            continue;
+        }
+
+        char c = s[i];
+        if (lclen && len - i >= lclen && memcmp(&s[i], syn->linecomment, lclen) == 0) {
+            hlMark(hl, i, len - i, FEMTO_ATTR_COMMENT);
+            return HL_NORMAL;
+        }
+        if (bslen && len - i >= bslen && memcmp(&s[i], syn->blockstart, bslen) == 0) {
+            hlMark(hl, i, bslen, FEMTO_ATTR_COMMENT);
+            i += bslen;
+            state = HL_COMMENT;
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            hlMark(hl, i, 1, FEMTO_ATTR_STRING);
+            i++;
+            state = c;
+            continue;
+        }
+        if (hl && sep && isdigit((unsigned char)c)) {
+            int j = i;
+            while (j < len && (isalnum((unsigned char)s[j]) || s[j] == '.')) j++;
+            hlMark(hl, i, j - i, FEMTO_ATTR_NUMBER);
+            i = j;
+            sep = 0;
+            continue;
+        }
+        if (hl && sep) {
+            int k;
+            for (k = 0; syn->keywords[k]; k++) {
+                int klen = strlen(syn->keywords[k]);
+                int type = syn->keywords[k][klen - 1] == '|';
+                if (type) klen--;
+                if (len - i >= klen && memcmp(&s[i], syn->keywords[k], klen) == 0 &&
+                        (i + klen == len || hlIsSeparator((unsigned char)s[i + klen]))) {
+                    hlMark(hl, i, klen, type ? FEMTO_ATTR_TYPE : FEMTO_ATTR_KEYWORD);
+                    i += klen;
+                    break;
+                }
+            }
+            if (syn->keywords[k]) {
+                sep = 0;
+                continue;
+            }
+        }
+        sep = hlIsSeparator((unsigned char)c);
+        i++;
+    }
+    // an unterminated string ends with its row
+    return state == HL_COMMENT ? HL_COMMENT : HL_NORMAL;
+}
+
+// picks the syntax for the file name, and forgets all lexer state
+void editorSelectSyntax() {
+    E.hl.syntax = NULL;
+    E.hl.lo = E.hl.hi = E.hl.lexed = 0;
+    for (int i = 0; i < E.render.n; i++) E.render.slot[i].hlok = 0;
+    if (E.filename == NULL) return;
+
+    size_t len = strlen(E.filename);
+    for (size_t j = 0; j < sizeof(HLDB) / sizeof(HLDB[0]); j++) {
+        for (const char** m = HLDB[j].filematch; *m; m++) {
+            size_t mlen = strlen(*m);
+            if (len >= mlen && strcmp(&E.filename[len - mlen], *m) == 0) {
+                E.hl.syntax = &HLDB[j];
+                return;
+            }
+        }
+    }
+}
+
+// the text of row at y changed
+void editorHlChanged(int y) {
+    if (y >= E.hl.lexed) return;
+    if (E.hl.lo > y) E.hl.lo = y;
+    if (E.hl.hi < y + 1) E.hl.hi = y + 1;
+}
+
+// a row was inserted at y; it and the row now below it are dirty
+void editorHlInserted(int y) {
+    if (y >= E.hl.lexed) return;
+    E.hl.lexed++;
+    if (E.hl.hi > y) E.hl.hi++;
+    if (E.hl.lo > y) E.hl.lo = y;
+    if (E.hl.hi < y + 2) E.hl.hi = y + 2 < E.hl.lexed ? y + 2 : E.hl.lexed;
+}
+
+// n rows at y were deleted; the one that took their place has a new neighbour
+void editorHlDeleted(int y, int n) {
+    if (y >= E.hl.lexed) return;
+    if (n > E.hl.lexed - y) n = E.hl.lexed - y;
+    E.hl.lexed -= n;
+    if (E.hl.hi > y) E.hl.hi = E.hl.hi - n > y ? E.hl.hi - n : y;
+    if (E.hl.lo > y) E.hl.lo = y;
+    if (E.hl.hi < y + 1) E.hl.hi = y + 1 < E.hl.lexed ? y + 1 : E.hl.lexed;
+    if (E.hl.lo > E.hl.hi) E.hl.lo = E.hl.hi;
+}
+
+// Stores the end state of row y, which was lexed from the right start state,
+// i.e. y is E.hl.lo. If it is what the row ended in before and no dirty row
+// follows, every row up to E.hl.lexed is right again.
+void editorHlDone(int y, erow* row, int state) {
+    int same = row->hlstate == (unsigned)state && y < E.hl.lexed && y + 1 >= E.hl.hi;
+    row->hlstate = state;
+    E.hl.lo = same ? E.hl.lexed : y + 1;
+    if (E.hl.lexed < E.hl.lo) E.hl.lexed = E.hl.lo;
+    if (E.hl.hi < E.hl.lo) E.hl.hi = E.hl.lo;
+}
+
+// the state row y starts in, lexing the rows above it that are not known
+int editorHlStart(int y) {
+    while (E.hl.lo < y) {
+        int i = E.hl.lo;
+        int state = i ? (int)editorRowSeek(&E.pos, i - 1)->hlstate : HL_NORMAL;
+        erow* row = editorRowSeek(&E.pos, i);
+        // the render, if cached, lexes the same and spares closing a gap
+        struct renderslot* s = editorRowCached(row);
+        if (s) state = hlLex(E.hl.syntax, s->render, s->rsize, state, NULL);
+        else state = hlLex(E.hl.syntax, editorRowText(row), row->size, state, NULL);
+        editorHlDone(i, row, state);
+    }
+    return y ? (int)editorRowSeek(&E.pos, y - 1)->hlstate : HL_NORMAL;
+}
+
+// The colours of the rendered row y, relexed only if its text or the state
+// it starts in changed since they were built.
+const unsigned char* editorHlRow(int y, erow* row, struct renderslot* s) {
+    int start = editorHlStart(y);
+    if (!s->hlok || s->hlstart != start) {
+        if (s->rsize > s->hlcap) {
+            int cap = s->rsize + s->hlcap;
+            s->hl = (unsigned char*)rowMemRealloc((char*)s->hl, s->hlcap, cap);
+            s->hlcap = cap;
+        }
+        s->hlend = hlLex(E.hl.syntax, s->render, s->rsize, start, s->hl);
+        s->hlstart = start;
+        s->hlok = 1;
+    }
+    if (E.hl.lo == y) editorHlDone(y, row, s->hlend);
+    return s->hl;
+}
+
+/*** soft wrap ***/
+// the text of row y changed, and with it maybe its screen lines
+void editorWrapChanged(int y) {
+    if (!E.wrap || y >= E.nrows) return;
+    rowTreeSetWidth(y, editorRowWidth(editorRowSeek(&E.pos, y)));
+}
+
+// Turns soft-wrap on, measuring every row once, or off, keeping the row at
+// the top of the screen where it is.
+void editorWrapToggle() {
+    rnode* leaf = E.root;
+    while (!leaf->leaf) leaf = leaf->kids[0];
+    if (!E.wrap) {
+        E.wrap = 1;
+        for (; leaf; leaf = leaf->next) {
+            rowNodeWidths(leaf);
+            if (leaf->packed) editorColdLoad(leaf);
+            for (int i = 0; i < leaf->n; i++) leaf->widths[i] = editorRowWidth(&leaf->rows[i]);
+        }
+        rowTreeCount(E.root);
+        E.rowoff = rowTreeLine(E.rowoff);
+        E.coloff = 0;
+    } else {
+        int sub;
+        E.rowoff = rowTreeFindLine(E.rowoff, &sub);
+        E.wrap = 0;
+        for (; leaf; leaf = leaf->next) {
+            E.mem.treebytes -= sizeof(int) * FEMTO_LEAF_ROWS;
+            free(leaf->widths);
+            leaf->widths = NULL;
+        }
+    }
+    editorInvalidateScreen();
+    editorSetStatusMessage("Soft-wrap %s", E.wrap ? "on" : "off");
+}
+
+// the column of cx in row while soft-wrapping, see wrapWalk
+int editorWrapRx(erow* row, int cx) {
+    int at;
+    if (editorRowAscii(row)) return editorRowCxToRx(row, cx);
+    return wrapWalk(editorRowText(row), row->size, cx, -1, &at);
+}
+
+// the character of row that soft-wrapped column rx falls in
+int editorWrapCx(erow* row, int rx) {
+    int at;
+    if (editorRowAscii(row)) return editorRowRxToCx(row, rx);
+    wrapWalk(editorRowText(row), row->size, row->size, rx, &at);
+    return at;
+}
+
+// Measures the rows again after the screen width changed; only rows with
+// wide characters can have their widths change.
+void editorWrapRemeasure() {
+    rnode* leaf = E.root;
+    while (!leaf->leaf) leaf = leaf->kids[0];
+    for (; leaf; leaf = leaf->next) {
+        for (int i = 0; i < leaf->n; i++) {
+            erow* row = &leaf->rows[i];
+            if (row->ascii == ROW_ASCII) continue;
+            if (leaf->packed) editorColdLoad(leaf);
+            leaf->widths[i] = editorRowWidth(row);
+        }
+    }
+}
+
+// the screen line of the cursor while soft-wrapping, and its column there
+int editorWrapCursor(int* col) {
+    int rx = 0;
+    if (E.cursorY < E.nrows) rx = editorWrapRx(editorRowSeek(&E.pos, E.cursorY), E.cursorX);
+    *col = rx % E.screenCols;
+    return rowTreeLine(E.cursorY) + rx / E.screenCols;
+}
+
+// puts the cursor on screen line `line`, as near column col of it as the
+// text allows
+void editorWrapMoveTo(int line, int col) {
+    if (line < 0) line = 0;
+    if (line > E.root->nlines) line = E.root->nlines;
+    int sub;
+    E.cursorY = rowTreeFindLine(line, &sub);
+    E.cursorX = 0;
+    if (E.cursorY < E.nrows) {
+        erow* row = editorRowSeek(&E.pos, E.cursorY);
+        E.cursorX = editorWrapCx(row, sub * E.screenCols + col);
+    }
+}
+
+/*** editor operations ***/
+
+// Between keypresses only the cursor row may hold a gap: once the cursor has
+// left row y, the gap there is closed. Other rows' chars can then be read as
+// they are, without going through editorRowChars.
+void editorGapRelease(int y) {
+    if (E.gap.chars == NULL) return;
+    if (E.cursorY < E.nrows && editorRowSeek(&E.pos, E.cursorY)->chars == E.gap.chars) return;
+    if (y < E.nrows) editorRowChars(editorRowSeek(&E.pos, y));
+}
+
+// closes the gap of the cursor row too, leaving every row contiguous
+void editorGapFlush() {
+    if (E.gap.chars && E.cursorY < E.nrows) editorRowChars(editorRowSeek(&E.pos, E.cursorY));
+}
+
+void editorInsertChar(int c) {
+    char ch = c;
+    int y = E.cursorY, x = E.cursorX, eof = E.cursorY == E.nrows;
+    editorJournalAdd(JOURNAL_CHAR, y, x, &ch, 1);
+    if (E.cursorY == E.nrows) {
+        editorInsertRow(E.nrows, "", 0);
+    }
+    editorRowInsertChar(editorRowAt(E.cursorY), E.cursorX, c);
+    editorHlChanged(E.cursorY);
+    editorWrapChanged(E.cursorY);
+    E.cursorX++;
+    editorUndoInserted(y, x, eof, UNDO_TYPED);
+}
+
+void editorInsertNewline() {
+    int y = E.cursorY, x = E.cursorX, eof = E.cursorY == E.nrows;
+    editorJournalAdd(JOURNAL_NEWLINE, y, x, NULL, 0);
+    if (E.cursorX == 0) {
+        editorInsertRow(E.cursorY, "", 0);
+    } else {
+        erow* row = editorRowAt(E.cursorY);
+        editorInsertRow(E.cursorY + 1, &editorRowChars(row)[E.cursorX], row->size - E.cursorX);
+        row = editorRowAt(E.cursorY);
+        editorRowDetach(row);
+        row->chars = rowMemRealloc(row->chars, row->size + 1, E.cursorX + 1);
+        row->size = E.cursorX;
+        row->chars[row->size] = '\0';
+        row->view = NULL;
+        editorUpdateRow(row);
+        editorHlChanged(E.cursorY);
+        editorWrapChanged(E.cursorY);
+    }
+    E.cursorY++;
+    E.cursorX = 0;
+    editorUndoInserted(y, x, eof, UNDO_BREAK);
+}
+
+// Inserts text at the cursor as one edit: a single line goes into the
+// cursor row at once, otherwise the row is split once, each line becomes a
+// row and the rest of the split row is appended to the last one.
+void editorInsertText(const char* s, size_t len) {
+    if (len == 0) return;
+    int y = E.cursorY, x = E.cursorX, eof = E.cursorY == E.nrows;
+    editorJournalAdd(JOURNAL_TEXT, y, x, s, len);
+    if (E.cursorY == E.nrows) {
+        editorInsertRow(E.nrows, "", 0);
+    }
+    erow* row = editorRowAt(E.cursorY);
+    char* chars = editorRowChars(row);
+    const char* nl = memchr(s, '\n', len);
+    size_t first = nl ? (size_t)(nl - s) : len;
+    size_t taillen = nl ? row->size - E.cursorX : 0;
+    char* tail = NULL;
+    if (nl) {
+        tail = malloc(taillen);
+        if (tail == NULL) die("malloc");
+        memcpy(tail, &chars[E.cursorX], taillen);
+    }
+
+    editorRowDetach(row);
+    int oldsize = row->size;
+    if (nl) {
+        // the rest of the row moves to the last line
+        row->chars[E.cursorX] = '\0';
+        row->size = E.cursorX;
+    }
+    row->chars = rowMemRealloc(row->chars, oldsize + 1, row->size + first + 1);
+    memmove(&row->chars[E.cursorX + first], &row->chars[E.cursorX], row->size - E.cursorX + 1);
+    memcpy(&row->chars[E.cursorX], s, first);
+    row->size += first;
+    row->view = NULL;
+    editorUpdateRow(row);
+    editorHlChanged(E.cursorY);
+    editorWrapChanged(E.cursorY);
+    E.cursorX += first;
+    E.sincemodif++;
+    if (!nl) {
+        editorUndoInserted(y, x, eof, UNDO_APART);
+        return;
+    }
+
+    s = nl + 1;
+    len -= first + 1;
+    while ((nl = memchr(s, '\n', len))) {
+        editorInsertRow(++E.cursorY, (char*)s, nl - s);
+        len -= nl - s + 1;
+        s = nl + 1;
+    }
+    char* last = malloc(len + taillen);
+    if (last == NULL) die("malloc");
+    memcpy(last, s, len);
+    memcpy(&last[len], tail, taillen);
+    editorInsertRow(++E.cursorY, last, len + taillen);
+    E.cursorX = len;
+    free(last);
+    free(tail);
+    editorUndoInserted(y, x, eof, UNDO_APART);
+}
+
+void editorDelChar() {
+    // return immediately if cursor is past end of the file
+    if (E.cursorY == E.nrows) return;
+    if (E.cursorX == 0 && E.cursorY == 0) return;
+    editorJournalAdd(JOURNAL_DELETE, E.cursorY, E.cursorX, NULL, 0);
+
+    erow* row = editorRowAt(E.cursorY);
+    if (E.cursorX > 0) {
+        // the whole cluster before the cursor goes
+        int at = editorRowSnap(row, E.cursorX - 1);
+        editorGapMove(row, E.cursorX, 0);
+        editorUndoDeleted(E.cursorY, at, &row->chars[at], E.cursorX - at);
+        while (E.cursorX > at) editorRowDelChar(row, --E.cursorX);
+        editorHlChanged(E.cursorY);
+        editorWrapChanged(E.cursorY);
+    } else {
+        erow* prev = editorRowAt(E.cursorY - 1);
+        editorUndoDeleted(E.cursorY - 1, prev->size, "\n", 1);
+        E.cursorX = prev->size;
+        editorRowAppendString(prev, editorRowChars(row), row->size);
+        editorHlChanged(E.cursorY - 1);
+        editorWrapChanged(E.cursorY - 1);
+        editorDelRow(E.cursorY);
+        E.cursorY--;
+    }
+}
+
+// Text between (y, x) and (y2, x2) with a newline after each row it leaves;
+// y2 == E.nrows means to the end of the buffer, the last row's newline
+// included. Rows that are views are read without being materialized.
+char* editorRangeText(int y, int x, int y2, int x2, size_t* len) {
+    if (y2 == E.nrows) x2 = 0;
+    size_t n = 0;
+    for (int i = y; i <= y2 && i < E.nrows; i++) {
+        erow* row = editorRowSeek(&E.pos, i);
+        n += (i == y2 ? x2 : row->size + 1) - (i == y ? x : 0);
+    }
+    char* text = malloc(n + 1);
+    if (text == NULL) die("malloc");
+    char* p = text;
+    for (int i = y; i <= y2 && i < E.nrows; i++) {
+        erow* row = editorRowSeek(&E.pos, i);
+        int from = i == y ? x : 0;
+        int to = i == y2 ? x2 : row->size;
+        memcpy(p, &editorRowText(row)[from], to - from);
+        p += to - from;
+        if (i < y2) *p++ = '\n';
+    }
+    *len = n;
+    return text;
+}
+
+// Erases the text between (y, x) and (y2, x2) as one edit: the rest of row
+// y2 is joined to row y and the rows between go in one bulk delete, however
+// many there are. y2 == E.nrows erases rows y to the end; x is then 0.
+void editorEraseText(int y, int x, int y2, int x2) {
+    editorJournalErase(y, x, y2, x2);
+    if (!E.undo.busy) {
+        struct undorec* r = editorUndoPush(UNDO_DELETE, y, x);
+        r->text = editorRangeText(y, x, y2, x2, &r->len);
+        r->eof = y2 == E.nrows;
+        E.undo.bytes += r->len;
+    }
+    if (y2 == E.nrows) {
+        editorDelRows(y, E.nrows - y);
+    } else {
+        erow* last = editorRowAt(y2);
+        size_t taillen = last->size - x2;
+        char* tail = malloc(taillen + 1);
+        if (tail == NULL) die("malloc");
+        memcpy(tail, &editorRowChars(last)[x2], taillen);
+
+        erow* row = editorRowAt(y);
+        editorRowChars(row);
+        editorRowDetach(row);
+        row->chars = rowMemRealloc(row->chars, row->size + 1, x + taillen + 1);
+        memcpy(&row->chars[x], tail, taillen);
+        row->size = x + taillen;
+        row->chars[row->size] = '\0';
+        row->view = NULL;
+        editorUpdateRow(row);
+        editorHlChanged(y);
+        editorWrapChanged(y);
+        editorDelRows(y + 1, y2 - y);
+        free(tail);
+    }
+    E.cursorY = y;
+    E.cursorX = x;
+    E.sincemodif++;
+    editorUndoTrim();
+}
+
+/*** undo ***/
+void editorUndoFree(struct undorec* r) {
+    E.undo.bytes -= sizeof(struct undorec) + r->len * (r->text != NULL);
+    free(r->text);
+}
+
+// drops records, oldest undo first, then furthest redo, until the history
+// fits its budget
+void editorUndoTrim() {
+    struct undolog* u = &E.undo;
+    while (u->bytes > u->budget && u->first < u->cur) editorUndoFree(&u->rec[u->first++]);
+    while (u->bytes > u->budget && u->n > u->cur) editorUndoFree(&u->rec[--u->n]);
+}
+
+// a new record on top of the undo history, which forgets what was undone
+struct undorec* editorUndoPush(int kind, int y, int x) {
+    struct undolog* u = &E.undo;
+    while (u->n > u->cur) editorUndoFree(&u->rec[--u->n]);
+    if (u->n == u->cap) {
+        if (u->first > 0) {
+            memmove(u->rec, &u->rec[u->first], sizeof(struct undorec) * (u->n - u->first));
+            u->n -= u->first;
+            u->cur -= u->first;
+            u->first = 0;
+        } else {
+            u->cap = u->cap ? u->cap * 2 : 64;
+            u->rec = realloc(u->rec, sizeof(struct undorec) * u->cap);
+            if (u->rec == NULL) die("realloc");
+        }
+    }
+    struct undorec* r = &u->rec[u->n++];
+    u->cur = u->n;
+    u->bytes += sizeof(struct undorec);
+    u->sealed = 0;
+    memset(r, 0, sizeof(*r));
+    r->kind = kind;
+    r->y = r->y2 = y;
+    r->x = r->x2 = x;
+    return r;
+}
+
+// the record an edit may join, if any
+struct undorec* editorUndoTop(int kind) {
+    struct undolog* u = &E.undo;
+    if (u->sealed || u->cur == u->first || u->cur != u->n) return NULL;
+    struct undorec* r = &u->rec[u->cur - 1];
+    return r->kind == kind ? r : NULL;
+}
+
+// Records text inserted from (y, x) to the cursor; eof if it went in past the
+// last row, which it then ends. Only where it lies is kept.
+void editorUndoInserted(int y, int x, int eof, int run) {
+    if (E.undo.busy) return;
+    struct undorec* r = editorUndoTop(UNDO_INSERT);
+    if (run != UNDO_TYPED || r == NULL || !r->run || r->y2 != y || r->x2 != x) {
+        r = editorUndoPush(UNDO_INSERT, y, x);
+        r->run = run != UNDO_APART;
+        r->eof = eof;
+    }
+    r->y2 = E.cursorY;
+    r->x2 = E.cursorX;
+    editorUndoTrim();
+}
+
+// Records the len bytes of s at (y, x) about to be deleted. Deletes next to
+// each other, backwards or forwards, go into one record.
+void editorUndoDeleted(int y, int x, const char* s, size_t len) {
+    if (E.undo.busy) return;
+    struct undorec* r = editorUndoTop(UNDO_DELETE);
+    int ey = y + (s[len - 1] == '\n'), ex = s[len - 1] == '\n' ? 0 : x + (int)len;
+    int back = r && r->text && ey == r->y && ex == r->x;
+    int forward = r && r->text && y == r->y && x == r->x;
+    if (!back && !forward) r = editorUndoPush(UNDO_DELETE, y, x);
+    r->text = realloc(r->text, r->len + len);
+    if (r->text == NULL) die("realloc");
+    if (back) {
+        memmove(&r->text[len], r->text, r->len);
+        memcpy(r->text, s, len);
+        r->y = y;
+        r->x = x;
+    } else {
+        memcpy(&r->text[r->len], s, len);
+    }
+    r->len += len;
+    E.undo.bytes += len;
+    editorUndoTrim();
+}
+
+// takes the text of r out of the rows, keeping it in r
+void editorUndoTake(struct undorec* r) {
+    int y2 = r->eof ? E.nrows : r->y2;
+    r->text = editorRangeText(r->y, r->x, y2, r->x2, &r->len);
+    E.undo.bytes += r->len;
+    editorEraseText(r->y, r->x, y2, r->x2);
+}
+
+// Puts the text of r back into the rows, through the edit operations so the
+// journal has it. Past the last row, the text's last newline is the one the
+// new rows end in.
+void editorUndoGive(struct undorec* r) {
+    E.cursorY = r->y;
+    E.cursorX = r->x;
+    size_t len = r->len - (r->eof && r->len > 0);
+    if (r->eof && len == 0) editorInsertNewline();
+    else editorInsertText(r->text, len);
+    r->y2 = E.cursorY;
+    r->x2 = E.cursorX;
+    E.undo.bytes -= r->len;
+    free(r->text);
+    r->text = NULL;
+}
+
+void editorUndo() {
+    struct undolog* u = &E.undo;
+    if (u->cur == u->first) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+    struct undorec* r = &u->rec[--u->cur];
+    u->busy = 1;
+    if (r->kind == UNDO_INSERT) editorUndoTake(r);
+    else editorUndoGive(r);
+    u->busy = 0;
+    u->sealed = 1;
+    editorUndoTrim();
+}
+
+// Rows are about to be added after the last one, so text that ended the
+// buffer now ends before them, newline and all.
+void editorUndoAppending() {
+    struct undolog* u = &E.undo;
+    for (int i = u->first; i < u->n; i++) {
+        struct undorec* r = &u->rec[i];
+        if (!r->eof) continue;
+        if (r->text == NULL) {
+            r->y2++;
+            r->x2 = 0;
+        }
+        r->eof = 0;
+    }
+}
+
+void editorRedo() {
+    struct undolog* u = &E.undo;
+    if (u->cur == u->n) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+    struct undorec* r = &u->rec[u->cur++];
+    u->busy = 1;
+    if (r->kind == UNDO_INSERT) editorUndoGive(r);
+    else editorUndoTake(r);
+    u->busy = 0;
+    u->sealed = 1;
+    editorUndoTrim();
+}
+
+
+/*** file io ***/
+// Appends the text of rows [from, to) to iov, one entry per row and newline.
+// Runs of rows that are still views of the file, separated by single
+// newlines there, go out as one entry straight from the mapping. Stops at a
+// packed leaf, which the caller adds whole. Returns the row after the last
+// one added; iov has room for at least two entries.
+int editorRowsToIov(int from, int to, struct iovec* iov, int* n, int max, size_t* len) {
+    static char newline[] = "\n";
+    const char* mapend = E.map + E.mapsize;
+    struct rowpos pos = {NULL, 0};
+    int i = from;
+    while (i < to && *n + 2 <= max) {
+        erow* row = editorRowSeek(&pos, i);
+        if (pos.leaf->packed) break;
+        i++;
+        const char* text = editorRowText(row);
+        const char* end = text + row->size;
+        int nl = 0;
+        if (row->view) {
+            while (i < to && end < mapend && *end == '\n') {
+                erow* next = editorRowSeek(&pos, i);
+                if (pos.leaf->packed || next->view != end + 1) break;
+                end = next->view + next->size;
+                i++;
+            }
+            if (end < mapend && *end == '\n') {
+                end++;
+                nl = 1;
+            }
+        }
+        if (end > text) {
+            iov[(*n)++] = (struct iovec){(void*)text, end - text};
+            *len += end - text;
+        }
+        if (!nl) {
+            iov[(*n)++] = (struct iovec){newline, 1};
+            (*len)++;
+        }
+    }
+    return i;
+}
+
+// writes out the whole of iov, picking up after short writes
+int editorWritev(int fd, struct iovec* iov, int n) {
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (n > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+void editorUnmap() {
+    if (E.map == NULL) return;
+    munmap(E.map, E.mapsize);
+    E.map = NULL;
+    E.mapsize = 0;
+}
+
+// The file was just replaced by the text of job, so rows that are still views
+// move to a mapping of the new file; each lies in one of the job's extents of
+// the old one. If the new file can't be mapped the old mapping stays; it
+// remains valid after the rename.
+void editorRemap(struct savejob* job) {
+    char* map = job->len ? mmap(NULL, job->len, PROT_READ, MAP_PRIVATE, job->fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) return;
+
+    struct rowpos pos = {NULL, 0};
+    int k = 0;
+    for (int i = 0; i < E.nrows; i++) {
+        erow* row = editorRowSeek(&pos, i);
+        if (row->view == NULL || pos.leaf->packed) continue;
+        // the views left are in mapping order, like the extents
+        while (k < job->nextents && row->view >= job->extents[k].view + job->extents[k].len) k++;
+        struct saveextent* ext = &job->extents[k];
+        if (k < job->nextents && row->view >= ext->view && row->view + row->size <= ext->view + ext->len) {
+            row->view = map + ext->off + (row->view - ext->view);
+        } else {
+            editorRowMaterialize(row);
+            row->view = NULL;
+        }
+    }
+    editorUnmap();
+    E.map = map;
+    E.mapsize = job->len;
+}
+
+// finds the lines of the mapping and queues them in chunks
+void* editorLoadWorker(void* arg) {
+    struct loadjob* job = arg;
+    const char* p = job->map;
+    const char* end = job->map + job->size;
+    int want = FEMTO_LOAD_FIRST;
+    while (p < end) {
+        struct loadchunk* chunk = malloc(sizeof(struct loadchunk) + sizeof(struct loadline) * want);
+        if (chunk == NULL) die("malloc");
+        chunk->next = NULL;
+        chunk->n = 0;
+        while (p < end && chunk->n < want) {
+            const char* nl = memchr(p, '\n', end - p);
+            size_t linelen = (nl ? nl : end) - p;
+            while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+            chunk->line[chunk->n++] = (struct loadline){p, linelen};
+            p = nl ? nl + 1 : end;
+        }
+        if (want < FEMTO_LOAD_CHUNK) want *= 2;
+
+        pthread_mutex_lock(&job->lock);
+        while (job->queued == FEMTO_LOAD_AHEAD) pthread_cond_wait(&job->room, &job->lock);
+        if (job->tail) job->tail->next = chunk;
+        else job->head = chunk;
+        job->tail = chunk;
+        job->queued++;
+        job->done = p == end;
+        pthread_cond_signal(&job->ready);
+        pthread_mutex_unlock(&job->lock);
+        editorWake();
+    }
+    return NULL;
+}
+
+// starts indexing the lines of a mapped file; their text stays in the mapping
+void editorOpenMapped(char* map, size_t size) {
+    E.map = map;
+    E.mapsize = size;
+
+    struct loadjob* job = calloc(1, sizeof(struct loadjob));
+    if (job == NULL) die("calloc");
+    job->map = map;
+    job->size = size;
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->ready, NULL);
+    pthread_cond_init(&job->room, NULL);
+    E.load = job;
+    if (pthread_create(&job->thread, NULL, editorLoadWorker, job) != 0) die("pthread_create");
+    // the first, small chunk is enough for the first frame
+    editorLoadStep(1);
+    E.sincemodif = 0;
+}
+
+// Adds the rows of the next chunk the loader queued, first waiting for one if
+// wait is set. Returns 1 if rows were added or the load is over.
+int editorLoadStep(int wait) {
+    struct loadjob* job = E.load;
+    if (job == NULL) return 0;
+    pthread_mutex_lock(&job->lock);
+    while (wait && job->head == NULL && !job->done) pthread_cond_wait(&job->ready, &job->lock);
+    struct loadchunk* chunk = job->head;
+    if (chunk) {
+        job->head = chunk->next;
+        if (job->head == NULL) job->tail = NULL;
+        job->queued--;
+        pthread_cond_signal(&job->room);
+    }
+    int over = job->done && job->head == NULL;
+    pthread_mutex_unlock(&job->lock);
+
+    if (chunk) {
+        editorAppendRowViews(chunk->line, chunk->n);
+        struct loadline* last = &chunk->line[chunk->n - 1];
+        job->added = last->view + last->size - job->map;
+        free(chunk);
+    }
+    if (over) {
+        pthread_join(job->thread, NULL);
+        pthread_mutex_destroy(&job->lock);
+        pthread_cond_destroy(&job->ready);
+        pthread_cond_destroy(&job->room);
+        free(job);
+        E.load = NULL;
+    }
+    return chunk || over;
+}
+
+// adds every row still to come, waiting for the loader
+void editorLoadFinish() {
+    while (E.load) editorLoadStep(1);
+}
+
+// percentage of the file loaded so far
+int editorLoadProgress() {
+    return E.load->size ? E.load->added * 100 / E.load->size : 100;
+}
+
+// saves go to filename from now on, as if it had been given at "Save as"
+void editorSetFilename(char* filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntax();
+}
+
+void editorOpen(char* filename) {
+    free(E.filename);
+    E.filename = strdup(filename);
+    editorSelectSyntax();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) die("open");
+
+    struct stat st;
+    // a followed file may be truncated under us, taking the pages of any
+    // view with it, so its rows are read in as copies
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= FEMTO_MMAP_MIN && !E.follow.nomap) {
+        char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            editorOpenMapped(map, st.st_size);
+            E.follow.off = st.st_size;
+            return;
+        }
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if (!fp) die("fdopen");
+
+    char* line = NULL;
+    size_t linecap = 0;
+    ssize_t linelen;
+    E.mem.bulk = 1;
+    E.follow.off = 0;
+    while ((linelen = getline(&line, &linecap, fp)) != -1) {
+        E.follow.off += linelen;
+        // strips last character if it is carriage return or newline
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r')) {
+            linelen--;
+        }
+        editorInsertRow(E.nrows, line, linelen);
+    }
+    E.mem.bulk = 0;
+    free(line);
+    fclose(fp);
+    E.sincemodif = 0;
+}
+
+// makes a rename in the directory holding path durable
+void editorSyncDir(const char* path) {
+    char* dir = strdup(path);
+    if (dir == NULL) die("strdup");
+    char* slash = strrchr(dir, '/');
+    if (slash == dir) dir[1] = '\0'; // the root directory
+    else if (slash) *slash = '\0';
+    int fd = open(slash ? dir : ".", O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        close(fd);
+    }
+    free(dir);
+}
+
+// whether p is chars the save in progress still has to write
+int editorSaveFrozen(char* p) {
+    struct savejob* job = E.save;
+    if (job == NULL || p == NULL) return 0;
+    size_t mask = job->frozencap - 1;
+    for (size_t h = ((uintptr_t)p >> 4) & mask; job->frozen[h]; h = (h + 1) & mask) {
+        if (job->frozen[h] == p) return 1;
+    }
+    return 0;
+}
+
+// Keeps frozen chars a row is giving up until the save is over. Returns 0 if
+// p is not frozen and can be freed now.
+int editorSaveKeep(char* p, size_t size) {
+    if (!editorSaveFrozen(p)) return 0;
+    struct savejob* job = E.save;
+    if (job->ndetached == job->detachedcap) {
+        job->detachedcap = job->detachedcap ? job->detachedcap * 2 : 16;
+        job->detached = realloc(job->detached, sizeof(struct rowblock) * job->detachedcap);
+        if (job->detached == NULL) die("realloc");
+    }
+    job->detached[job->ndetached].p = p;
+    job->detached[job->ndetached].size = size;
+    job->ndetached++;
+    return 1;
+}
+
+// gives row its own copy of its chars if the save in progress is writing them
+void editorRowDetach(erow* row) {
+    if (!editorSaveFrozen(row->chars)) return;
+    char* copy = rowMemAlloc(row->size + 1);
+    memcpy(copy, row->chars, row->size + 1);
+    editorSaveKeep(row->chars, row->size + 1);
+    row->chars = copy;
+}
+
+void* editorSaveWorker(void* arg) {
+    struct savejob* job = arg;
+    int err = 0;
+    int fd = mkstemp(job->tmp);
+    if (fd != -1) {
+        struct stat st;
+        // 0644 is std permissions you usually wants for text file
+        fchmod(fd, stat(job->path, &st) == 0 ? st.st_mode & 07777 : 0644);
+        struct timespec last = job->start, now;
+        int p = 0;
+        for (int i = 0; i < job->niov && err == 0; i += FEMTO_IOV_MAX) {
+            int n = job->niov - i < FEMTO_IOV_MAX ? job->niov - i : FEMTO_IOV_MAX;
+            // the packed leaves among these are unpacked just to be written
+            char* unpacked[FEMTO_IOV_MAX];
+            int nunpacked = 0;
+            for (; p < job->npacked && job->packed[p] < i + n && err == 0; p++) {
+                struct iovec* v = &job->iov[job->packed[p]];
+                char* text = malloc(v->iov_len);
+                if (text == NULL) {
+                    err = ENOMEM;
+                    break;
+                }
+                lzDecompress(v->iov_base, text, v->iov_len);
+                v->iov_base = text;
+                unpacked[nunpacked++] = text;
+            }
+            size_t bytes = 0;
+            for (int k = i; k < i + n; k++) bytes += job->iov[k].iov_len;
+            if (err == 0 && editorWritev(fd, &job->iov[i], n) == -1) err = errno;
+            for (int k = 0; k < nunpacked; k++) free(unpacked[k]);
+
+            pthread_mutex_lock(&job->lock);
+            job->written += bytes;
+            pthread_mutex_unlock(&job->lock);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ((now.tv_sec - last.tv_sec) * 1000 + (now.tv_nsec - last.tv_nsec) / 1000000 >= 100) {
+                last = now;
+                editorWake(); // progress for the status bar
+            }
+        }
+        if (err == 0 && (fsync(fd) == -1 || rename(job->tmp, job->path) == -1)) err = errno;
+        if (err) {
+            unlink(job->tmp);
+            close(fd);
+            fd = -1;
+        } else {
+            editorSyncDir(job->path);
+        }
+    } else {
+        err = errno;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->fd = fd;
+    job->done = 1;
+    pthread_mutex_unlock(&job->lock);
+    editorWake();
+    return NULL;
+}
+
+// Snapshots the rows as iovecs, noting the runs of the file mapping among
+// them and freezing the chars of the other rows. A packed leaf is one entry
+// of its compressed block, which is frozen the same way.
+void editorSaveSnapshot(struct savejob* job) {
+    int cap = 1024, packedcap = 0;
+    job->iov = malloc(sizeof(struct iovec) * cap);
+    if (job->iov == NULL) die("malloc");
+    struct rowpos pos = {NULL, 0};
+    int i = 0;
+    while (i < E.nrows) {
+        if (cap - job->niov < 2) {
+            cap *= 2;
+            job->iov = realloc(job->iov, sizeof(struct iovec) * cap);
+            if (job->iov == NULL) die("realloc");
+        }
+        editorRowSeek(&pos, i);
+        rnode* leaf = pos.leaf;
+        if (leaf->packed == NULL) {
+            i = editorRowsToIov(i, E.nrows, job->iov, &job->niov, cap, &job->len);
+            continue;
+        }
+        if (job->npacked == packedcap) {
+            packedcap = packedcap ? packedcap * 2 : 64;
+            job->packed = realloc(job->packed, sizeof(int) * packedcap);
+            if (job->packed == NULL) die("realloc");
+        }
+        job->packed[job->npacked++] = job->niov;
+        job->iov[job->niov++] = (struct iovec){leaf->packed, leaf->rawsize};
+        job->len += leaf->rawsize;
+        i += leaf->n;
+    }
+
+    int nchars = 0;
+    for (int k = 0; k < job->niov; k++) {
+        const char* p = job->iov[k].iov_base;
+        if (E.map && p >= E.map && p < E.map + E.mapsize) job->nextents++;
+        else if (job->iov[k].iov_len > 1 || *p != '\n') nchars++;
+    }
+    job->extents = malloc(sizeof(struct saveextent) * (job->nextents + 1));
+    job->frozencap = 16;
+    while (job->frozencap < (size_t)nchars * 2) job->frozencap *= 2;
+    job->frozen = calloc(job->frozencap, sizeof(char*));
+    if (job->extents == NULL || job->frozen == NULL) die("malloc");
+
+    size_t off = 0, mask = job->frozencap - 1;
+    int e = 0;
+    for (int k = 0; k < job->niov; k++) {
+        char* p = job->iov[k].iov_base;
+        if (E.map && p >= E.map && p < E.map + E.mapsize) {
+            job->extents[e].view = p;
+            job->extents[e].len = job->iov[k].iov_len;
+            job->extents[e].off = off;
+            e++;
+        } else if (job->iov[k].iov_len > 1 || *p != '\n') {
+            size_t h = ((uintptr_t)p >> 4) & mask;
+            while (job->frozen[h]) h = (h + 1) & mask;
+            job->frozen[h] = p;
+        }
+        off += job->iov[k].iov_len;
+    }
+}
+
+// Starts writing the buffer out in the background. The text goes to a
+// temporary file next to the target, which then replaces it in one rename, so
+// a failed save leaves the old file intact.
+void editorSave() {
+    if (E.save) {
+        editorSetStatusMessage("Save already in progress");
+        return;
+    }
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+        editorSelectSyntax();
+    }
+
+    struct savejob* job = calloc(1, sizeof(struct savejob));
+    if (job == NULL) die("calloc");
+    clock_gettime(CLOCK_MONOTONIC, &job->start);
+    job->path = realpath(E.filename, NULL);
+    if (job->path == NULL) job->path = strdup(E.filename);
+    if (job->path == NULL || (job->tmp = malloc(strlen(job->path) + 8)) == NULL) die("malloc");
+    sprintf(job->tmp, "%s.XXXXXX", job->path);
+
+    editorGapFlush();
+    editorSaveSnapshot(job);
+    job->modif = E.sincemodif;
+    // edits recorded from here on are not in the saved file
+    editorJournalCommit();
+    if (E.journal.fd != -1) E.journal.mark = lseek(E.journal.fd, 0, SEEK_END);
+    pthread_mutex_init(&job->lock, NULL);
+    E.save = job;
+    if (pthread_create(&job->thread, NULL, editorSaveWorker, job) != 0) die("pthread_create");
+}
+
+// Finishes off the save in progress once its writer is done, or right away
+// after waiting for it. Returns 1 if a save was finished.
+int editorSaveFinish(int wait) {
+    struct savejob* job = E.save;
+    if (job == NULL) return 0;
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    pthread_mutex_unlock(&job->lock);
+    if (!done && !wait) return 0;
+    pthread_join(job->thread, NULL);
+
+    if (job->err == 0) {
+        // rows that are still views of the old file move to the new one
+        if (E.map) editorRemap(job);
+        editorJournalSaved(job->fd);
+        close(job->fd);
+        E.sincemodif -= job->modif; // edits made while saving are still unsaved
+
+        struct timespec stop;
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        double secs = stop.tv_sec - job->start.tv_sec + (stop.tv_nsec - job->start.tv_nsec) / 1e9;
+        char rate[16];
+        editorFormatSize(rate, sizeof(rate), secs > 0 ? job->len / secs : 0);
+        editorSetStatusMessage("%zu bytes written to disk in %.2fs (%s/s)", job->len, secs, rate);
+    } else {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(job->err));
+    }
+
+    E.save = NULL;
+    for (int i = 0; i < job->ndetached; i++) rowMemFree(job->detached[i].p, job->detached[i].size);
+    pthread_mutex_destroy(&job->lock);
+    free(job->detached);
+    free(job->packed);
+    free(job->frozen);
+    free(job->extents);
+    free(job->iov);
+    free(job->path);
+    free(job->tmp);
+    free(job);
+    return 1;
+}
+
+// percentage of the save in progress written so far
+int editorSaveProgress() {
+    pthread_mutex_lock(&E.save->lock);
+    int pct = E.save->len ? E.save->written * 100 / E.save->len : 100;
+    pthread_mutex_unlock(&E.save->lock);
+    return pct;
+}
+
+/*** follow ***/
+// Starts following the open file as it grows. Returns -1, with errno set, if
+// it can't be reopened or watched.
+int editorFollowStart() {
+    struct follow* fw = &E.follow;
+    fw->fd = open(E.filename, O_RDONLY);
+    if (fw->fd == -1) return -1;
+    fw->buf = malloc(FEMTO_FOLLOW_CHUNK);
+    if (fw->buf == NULL) die("malloc");
+    // the last line read may still be being written
+    char c;
+    fw->partial = fw->off > 0 && pread(fw->fd, &c, 1, fw->off - 1) == 1 && c != '\n';
+    fw->checked = editorNow();
+#ifdef FEMTO_INOTIFY
+    fw->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fw->inotify == -1 || inotify_add_watch(fw->inotify, E.filename, IN_MODIFY) == -1) {
+        int err = errno;
+        if (fw->inotify != -1) close(fw->inotify);
+        close(fw->fd);
+        fw->fd = fw->inotify = -1;
+        errno = err;
+        return -1;
+    }
+#endif
+    // anything written since the file was loaded
+    fw->changed = 1;
+    return 0;
+}
+
+// whether the followed file may have grown since it was last read
+int editorFollowDue() {
+    // appended lines go after the last row of the file as it was opened
+    if (E.follow.fd == -1 || E.load) return 0;
+    if (E.follow.inotify == -1) return editorNow() - E.follow.checked >= FEMTO_FOLLOW_MS;
+    return E.follow.changed;
+}
+
+// adds n bytes read from the followed file as rows, the first finishing the
+// last row if it had no newline yet
+void editorFollowLines(const char* p, size_t n) {
+    const char* end = p + n;
+    if (n > 0 && *p == '\n' && E.follow.partial && E.nrows > 0) {
+        // the \r of a \r\n split across two reads
+        erow* row = editorRowAt(E.nrows - 1);
+        while (row->size > 0 && editorRowChars(row)[row->size - 1] == '\r') {
+            editorRowDelChar(row, row->size - 1);
+        }
+    }
+    while (p < end) {
+        const char* nl = memchr(p, '\n', end - p);
+        size_t len = (nl ? nl : end) - p;
+        if (nl) {
+            while (len > 0 && p[len - 1] == '\r') len--;
+        }
+        if (E.follow.partial && E.nrows > 0) {
+            editorRowAppendString(editorRowAt(E.nrows - 1), (char*)p, len);
+            editorHlChanged(E.nrows - 1);
+            editorWrapChanged(E.nrows - 1);
+        } else {
+            editorInsertRow(E.nrows, (char*)p, len);
+        }
+        E.follow.partial = nl == NULL;
+        p = nl ? nl + 1 : end;
+    }
+}
+
+// Reads what was appended to the followed file since the last read, up to
+// FEMTO_FOLLOW_MAX bytes; the rest is left for the next pass so a burst
+// doesn't hold up the screen. A cursor on the last row stays on the last row.
+void editorFollowRead() {
+    struct follow* fw = &E.follow;
+    fw->changed = 0;
+    fw->checked = editorNow();
+    struct stat st;
+    if (fstat(fw->fd, &st) == -1) return;
+    if (st.st_size < fw->off) {
+        editorSetStatusMessage("%s was truncated, following from its start", E.filename);
+        fw->off = 0;
+        fw->partial = fw->held = 0;
+    }
+    if (st.st_size == fw->off) return;
+    // a \r held back last time is read now if nothing came after it
+    int held = fw->held;
+    fw->held = 0;
+
+    int atend = E.cursorY >= E.nrows - 1;
+    int past = E.cursorY == E.nrows;
+    int modif = E.sincemodif;
+    editorUndoAppending();
+    off_t stop = st.st_size - fw->off > FEMTO_FOLLOW_MAX ? fw->off + FEMTO_FOLLOW_MAX : st.st_size;
+    E.mem.bulk = 1;
+    while (fw->off < stop) {
+        size_t want = stop - fw->off < FEMTO_FOLLOW_CHUNK ? stop - fw->off : FEMTO_FOLLOW_CHUNK;
+        ssize_t n = pread(fw->fd, fw->buf, want, fw->off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) break;
+        // a \r that may be the start of a \r\n waits for the next read, or
+        // the next pass when it ends the file
+        if (fw->buf[n - 1] == '\r' && (n > 1 || (fw->off + 1 == st.st_size && !held))) {
+            if (--n == 0) {
+                fw->held = 1;
+                break;
+            }
+        }
+        editorFollowLines(fw->buf, n);
+        fw->off += n;
+    }
+    E.mem.bulk = 0;
+    fw->changed = fw->off + fw->held < st.st_size;
+    // the rows read are what the file holds, not edits
+    E.sincemodif = modif;
+
+    if (atend) {
+        E.cursorY = past ? E.nrows : E.nrows - 1;
+        E.cursorX = 0;
+    }
+}
+
+/*** journal ***/
+// numbers in records are unsigned LEB128: 7 bits a byte, low bits first
+char* journalPutNum(char* p, size_t v) {
+    while (v >= 0x80) {
+        *p++ = (char)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (char)v;
+    return p;
+}
+
+// reads a number ending before end; NULL if it is cut short
+const char* journalGetNum(const char* p, const char* end, size_t* v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char b = *p++;
+        *v |= (size_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return p;
+    }
+    return NULL;
+}
+
+// .name.femto-journal in the directory of path
+char* editorJournalPath(const char* path) {
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char* jpath = malloc(strlen(path) + 16);
+    if (jpath == NULL) die("malloc");
+    sprintf(jpath, "%.*s.%s.femto-journal", (int)(base - path), path, base);
+    return jpath;
+}
+
+void editorJournalHead(struct journalhead* h, const struct stat* st) {
+    memcpy(h->magic, FEMTO_JOURNAL_MAGIC, sizeof(h->magic));
+    h->size = st->st_size;
+    h->mtime = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// room for a record of op at row y, column x with up to `more` bytes after
+char* editorJournalRecord(int op, int y, int x, size_t more) {
+    struct journal* j = &E.journal;
+    if (j->cap - j->len < more + 32) {
+        j->cap = (j->len + more + 32) * 2;
+        j->buf = realloc(j->buf, j->cap);
+        if (j->buf == NULL) die("realloc");
+    }
+    if (j->len == 0) j->due = editorNow() + FEMTO_JOURNAL_MS;
+    char* p = &j->buf[j->len];
+    *p++ = op;
+    p = journalPutNum(p, y);
+    return journalPutNum(p, x);
+}
+
+// records an edit about to be made at row y, column x
+void editorJournalAdd(int op, int y, int x, const char* s, size_t len) {
+    struct journal* j = &E.journal;
+    if (j->fd == -1) return;
+    char* p = editorJournalRecord(op, y, x, len);
+    if (op == JOURNAL_CHAR) {
+        *p++ = s[0];
+    } else if (op == JOURNAL_TEXT) {
+        p = journalPutNum(p, len);
+        memcpy(p, s, len);
+        p += len;
+    }
+    j->len = p - j->buf;
+    if (j->len >= FEMTO_JOURNAL_BUF) editorJournalCommit();
+}
+
+void editorJournalErase(int y, int x, int y2, int x2) {
+    struct journal* j = &E.journal;
+    if (j->fd == -1) return;
+    char* p = editorJournalRecord(JOURNAL_ERASE, y, x, 0);
+    p = journalPutNum(p, y2);
+    p = journalPutNum(p, x2);
+    j->len = p - j->buf;
+    if (j->len >= FEMTO_JOURNAL_BUF) editorJournalCommit();
+}
+
+// whether buffered records have waited long enough to be written
+int editorJournalDue() {
+    return E.journal.len && editorNow() >= E.journal.due;
+}
+
+// Writes the buffered records to the journal in one go. Once they are in
+// the page cache, they outlive the editor being killed or losing its
+// terminal; they are not synced, which would stall typing on a slow disk.
+void editorJournalCommit() {
+    struct journal* j = &E.journal;
+    if (j->fd == -1 || j->len == 0) return;
+    struct iovec iov = {j->buf, j->len};
+    if (editorWritev(j->fd, &iov, 1) == -1) {
+        editorSetStatusMessage("Journal stopped, can't write it: %s", strerror(errno));
+        close(j->fd);
+        j->fd = -1;
+    }
+    j->len = 0;
+}
+
+// Starts an empty journal for the file as st describes it. Returns -1 if it
+// can't be written.
+int editorJournalStart(const struct stat* st) {
+    struct journal* j = &E.journal;
+    if (j->path == NULL) j->path = editorJournalPath(E.filename);
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (j->fd == -1) return -1;
+    struct journalhead h;
+    editorJournalHead(&h, st);
+    // another femto editing the file holds the lock, and its journal is left be
+    if (flock(j->fd, LOCK_EX | LOCK_NB) == -1 || ftruncate(j->fd, 0) == -1 ||
+        write(j->fd, &h, sizeof(h)) != sizeof(h)) {
+        int err = errno;
+        close(j->fd);
+        j->fd = -1;
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// asks whether to replay the journal found for the open file
+int editorJournalAsk() {
+    editorSetStatusMessage("Unsaved edits to this file were found. Recover them? (y/n)");
+    int c;
+    do {
+        E.prompting = 1;
+        editorRefreshScreen();
+        c = editorReadKey();
+    } while (c != 'y' && c != 'Y' && c != 'n' && c != 'N' && c != '\x1b');
+    E.prompting = 0;
+    editorSetStatusMessage("");
+    return c == 'y' || c == 'Y';
+}
+
+// Reads one record from p, stopping before end, and applies it with the
+// cursor where the edit was made. Returns the record's end, or NULL if it is
+// cut short or does not fit the rows.
+const char* editorJournalApply(const char* p, const char* end) {
+    int op = *p++;
+    size_t y, x, len = 0, y2 = 0, x2 = 0;
+    if ((p = journalGetNum(p, end, &y)) == NULL || (p = journalGetNum(p, end, &x)) == NULL) return NULL;
+    const char* text = p;
+    if (op == JOURNAL_CHAR) {
+        len = 1;
+    } else if (op == JOURNAL_TEXT) {
+        if ((text = journalGetNum(p, end, &len)) == NULL) return NULL;
+    } else if (op == JOURNAL_ERASE) {
+        if ((p = journalGetNum(p, end, &y2)) == NULL || (text = journalGetNum(p, end, &x2)) == NULL) return NULL;
+        // to the end of the buffer only from the start of a row
+        if (y2 < y || y2 > (size_t)E.nrows || (y2 == y && x2 < x)) return NULL;
+        if (y2 == (size_t)E.nrows ? x != 0 : x2 > (size_t)editorRowAt(y2)->size) return NULL;
+    } else if (op != JOURNAL_NEWLINE && op != JOURNAL_DELETE) {
+        return NULL;
+    }
+    if ((size_t)(end - text) < len) return NULL;
+    if (y > (size_t)E.nrows || x > (y < (size_t)E.nrows ? (size_t)editorRowAt(y)->size : 0)) return NULL;
+
+    int from = E.cursorY;
+    E.cursorY = y;
+    E.cursorX = x;
+    editorGapRelease(from);
+    switch (op) {
+        case JOURNAL_CHAR: editorInsertChar((unsigned char)text[0]); break;
+        case JOURNAL_TEXT: editorInsertText(text, len); break;
+        case JOURNAL_NEWLINE: editorInsertNewline(); break;
+        case JOURNAL_DELETE: editorDelChar(); break;
+        case JOURNAL_ERASE: editorEraseText(y, x, y2, x2); break;
+    }
+    editorGapRelease(y);
+    return text + len;
+}
+
+// Replays the records of journal fd onto the rows, which hold the file it was
+// started on. A record cut short by a crash, and anything after it, is cut
+// off the journal so new records can follow; returns -1 if that fails.
+int editorJournalReplay(int fd) {
+    editorLoadFinish();
+    off_t size = lseek(fd, 0, SEEK_END);
+    size_t n = size - sizeof(struct journalhead);
+    char* buf = malloc(n);
+    if (buf == NULL) die("malloc");
+    size_t got = 0;
+    while (got < n) {
+        ssize_t r = pread(fd, buf + got, n - got, sizeof(struct journalhead) + got);
+        if (r == -1 && errno == EINTR) continue;
+        if (r <= 0) break;
+        got += r;
+    }
+
+    const char* p = buf;
+    const char* next;
+    int edits = 0;
+    while (p < buf + got && (next = editorJournalApply(p, buf + got))) {
+        p = next;
+        edits++;
+    }
+    size_t used = p - buf;
+    free(buf);
+    editorSetStatusMessage("Recovered %d edits from the journal", edits);
+    if (used < n && ftruncate(fd, sizeof(struct journalhead) + used) == -1) return -1;
+    return lseek(fd, 0, SEEK_END) == -1 ? -1 : 0;
+}
+
+// Starts journaling edits to the open file, after replaying the journal an
+// earlier editor left behind if the file has not changed since and the user
+// wants it.
+void editorJournalOpen() {
+    if (E.filename == NULL) return;
+    struct journal* j = &E.journal;
+    struct stat st;
+    if (stat(E.filename, &st) == -1) return;
+    j->path = editorJournalPath(E.filename);
+
+    int fd = open(j->path, O_RDWR | O_CLOEXEC);
+    if (fd != -1) {
+        struct journalhead h, want;
+        editorJournalHead(&want, &st);
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+            close(fd);
+            editorSetStatusMessage("%s is open in another femto; edits here are not journaled", E.filename);
+            return;
+        }
+        if (pread(fd, &h, sizeof(h), 0) == sizeof(h) && memcmp(&h, &want, sizeof(h)) == 0 &&
+            lseek(fd, 0, SEEK_END) > (off_t)sizeof(h) && editorJournalAsk()) {
+            if (editorJournalReplay(fd) == 0) {
+                j->fd = fd;
+            } else {
+                close(fd);
+                editorSetStatusMessage("Edits recovered, but the journal can't go on: %s", strerror(errno));
+            }
+            return;
+        }
+        // a journal that is not wanted, or for another version of the file
+        close(fd);
+    }
+    if (editorJournalStart(&st) == -1) {
+        editorSetStatusMessage("Can't journal edits to %s: %s", j->path, strerror(errno));
+    }
+}
+
+// Starts the journal over once the file has been saved as fd, keeping the
+// edits made while it was written. A buffer saved for the first time gets
+// its first journal.
+void editorJournalSaved(int fd) {
+    struct journal* j = &E.journal;
+    struct stat st;
+    if (fstat(fd, &st) == -1) return;
+    if (j->fd == -1) {
+        if (E.tty && E.follow.fd == -1 && j->path == NULL) editorJournalStart(&st);
+        return;
+    }
+    editorJournalCommit();
+    off_t end = lseek(j->fd, 0, SEEK_END);
+    size_t n = end > j->mark ? end - j->mark : 0;
+    char* tail = malloc(n + 1);
+    if (tail == NULL) die("malloc");
+    if (pread(j->fd, tail, n, j->mark) != (ssize_t)n) n = 0;
+
+    struct journalhead h;
+    editorJournalHead(&h, &st);
+    struct iovec iov[2] = {{&h, sizeof(h)}, {tail, n}};
+    if (ftruncate(j->fd, 0) == -1 || lseek(j->fd, 0, SEEK_SET) == -1 || editorWritev(j->fd, iov, 2) == -1) {
+        editorSetStatusMessage("Journal stopped, can't write it: %s", strerror(errno));
+        close(j->fd);
+        j->fd = -1;
+    }
+    free(tail);
+}
+
+// ends the journal as the editor quits; what was not saved is given up
+void editorJournalClose() {
+    if (E.journal.fd == -1) return;
+    close(E.journal.fd);
+    unlink(E.journal.path);
+    E.journal.fd = -1;
+}
+
+/*** regex ***/
+struct reparse {
+    const char* p;
+    struct regex* re;
+    struct renode* nodes;
+    int nnodes;
+    int cap;
+    int err;
+};
+
+int reNode(struct reparse* ps, int op, int a, int b) {
+    if (ps->nnodes == ps->cap) {
+        ps->cap = ps->cap ? ps->cap * 2 : 32;
+        ps->nodes = realloc(ps->nodes, sizeof(struct renode) * ps->cap);
+        if (ps->nodes == NULL) die("realloc");
+    }
+    struct renode* n = &ps->nodes[ps->nnodes];
+    n->op = op;
+    n->a = a;
+    n->b = b;
+    n->lit = -1;
+    return ps->nnodes++;
+}
+
+int reSetNew(struct regex* re) {
+    re->sets = realloc(re->sets, sizeof(struct reset) * (re->nsets + 1));
+    if (re->sets == NULL) die("realloc");
+    memset(&re->sets[re->nsets], 0, sizeof(struct reset));
+    return re->nsets++;
+}
+
+void reSetAdd(struct reset* set, int from, int to) {
+    for (int c = from; c <= to; c++) set->bits[c / 8] |= 1 << (c % 8);
+}
+
+int reSetHas(struct reset* set, int c) {
+    return set->bits[c / 8] >> (c % 8) & 1;
+}
+
+// adds the bytes of a \d, \w or \s style escape; returns 0 if c is not one
+int reSetEscape(struct reset* set, int c) {
+    struct reset t;
+    memset(&t, 0, sizeof(t));
+    switch (tolower(c)) {
+        case 'd': reSetAdd(&t, '0', '9'); break;
+        case 'w': reSetAdd(&t, '0', '9'); reSetAdd(&t, 'a', 'z'); reSetAdd(&t, 'A', 'Z');
+                  reSetAdd(&t, '_', '_'); break;
+        case 's': reSetAdd(&t, ' ', ' '); reSetAdd(&t, '\t', '\r'); break;
+        default: return 0;
+    }
+    for (int i = 0; i < 256; i++) {
+        if (reSetHas(&t, i) != (isupper(c) != 0)) reSetAdd(set, i, i);
+    }
+    return 1;
+}
+
+int reParseAlt(struct reparse* ps);
+
+// [...] with the opening bracket already consumed
+int reParseClass(struct reparse* ps) {
+    int set = reSetNew(ps->re);
+    struct reset t;
+    memset(&t, 0, sizeof(t));
+    int neg = *ps->p == '^';
+    if (neg) ps->p++;
+    int first = 1;
+    while (*ps->p != ']' || first) {
+        if (*ps->p == '\0' || (ps->p[0] == '\\' && ps->p[1] == '\0')) {
+            ps->err = 1;
+            return set;
+        }
+        int c = (unsigned char)*ps->p++;
+        first = 0;
+        if (c == '\\') {
+            c = (unsigned char)*ps->p++;
+            if (reSetEscape(&t, c)) continue;
+        }
+        int to = c;
+        if (ps->p[0] == '-' && ps->p[1] != ']' && ps->p[1] != '\0') {
+            to = (unsigned char)ps->p[1];
+            ps->p += 2;
+            if (to < c) ps->err = 1;
+        }
+        reSetAdd(&t, c, to);
+    }
+    ps->p++;
+    for (int i = 0; i < 256; i++) {
+        if (reSetHas(&t, i) != neg) reSetAdd(&ps->re->sets[set], i, i);
+    }
+    return set;
+}
+
+int reParseAtom(struct reparse* ps) {
+    int c = (unsigned char)*ps->p++;
+    int set;
+    switch (c) {
+        case '(': {
+            int n = reParseAlt(ps);
+            if (*ps->p != ')') ps->err = 1;
+            else ps->p++;
+            return n;
+        }
+        case '*': case '+': case '?':
+            ps->err = 1; // nothing to repeat
+            return reNode(ps, RE_EMPTY, 0, 0);
+        case '[':
+            return reNode(ps, RE_SET, reParseClass(ps), 0);
+        case '.':
+            set = reSetNew(ps->re);
+            reSetAdd(&ps->re->sets[set], 0, 255);
+            return reNode(ps, RE_SET, set, 0);
+        case '^':
+            return reNode(ps, RE_BEGIN, 0, 0);
+        case '$':
+            return reNode(ps, RE_END, 0, 0);
+        case '\\':
+            c = (unsigned char)*ps->p++;
+            if (c == '\0') {
+                ps->err = 1;
+                ps->p--;
+                return reNode(ps, RE_EMPTY, 0, 0);
+            }
+            set = reSetNew(ps->re);
+            if (reSetEscape(&ps->re->sets[set], c)) return reNode(ps, RE_SET, set, 0);
+            break;
+        default:
+            set = reSetNew(ps->re);
+            break;
+    }
+    reSetAdd(&ps->re->sets[set], c, c);
+    int n = reNode(ps, RE_SET, set, 0);
+    ps->nodes[n].lit = c;
+    return n;
+}
+
+int reParseCat(struct reparse* ps) {
+    int n = -1;
+    while (*ps->p && *ps->p != '|' && *ps->p != ')' && !ps->err) {
+        int r = reParseAtom(ps);
+        while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+            char q = *ps->p++;
+            r = reNode(ps, q == '*' ? RE_STAR : q == '+' ? RE_PLUS : RE_QUEST, r, 0);
+        }
+        n = n < 0 ? r : reNode(ps, RE_CAT, n, r);
+    }
+    return n < 0 ? reNode(ps, RE_EMPTY, 0, 0) : n;
+}
+
+int reParseAlt(struct reparse* ps) {
+    int n = reParseCat(ps);
+    while (*ps->p == '|' && !ps->err) {
+        ps->p++;
+        n = reNode(ps, RE_ALT, n, reParseCat(ps));
+    }
+    return n;
+}
+
+int reEmit(struct restate** nfa, int* n, int op, int out, int out1, int set) {
+    if ((*n & (*n - 1)) == 0) { // grows at powers of two
+        *nfa = realloc(*nfa, sizeof(struct restate) * (*n ? *n * 2 : 1));
+        if (*nfa == NULL) die("realloc");
+    }
+    struct restate* s = &(*nfa)[*n];
+    s->op = op;
+    s->out = out;
+    s->out1 = out1;
+    s->set = set;
+    return (*n)++;
+}
+
+// Compiles node so that it continues into NFA state next; returns its first
+// state. Reversed, concatenations are emitted back to front.
+int reCompile(struct renode* nodes, int node, int next, int rev,
+        struct restate** nfa, int* n) {
+    struct renode* t = &nodes[node];
+    int s, body;
+    switch (t->op) {
+        case RE_SET:
+            return reEmit(nfa, n, RE_SET, next, -1, t->a);
+        case RE_CAT:
+            if (rev) return reCompile(nodes, t->b, reCompile(nodes, t->a, next, rev, nfa, n), rev, nfa, n);
+            return reCompile(nodes, t->a, reCompile(nodes, t->b, next, rev, nfa, n), rev, nfa, n);
+        case RE_ALT:
+            s = reCompile(nodes, t->a, next, rev, nfa, n);
+            return reEmit(nfa, n, RE_SPLIT, s, reCompile(nodes, t->b, next, rev, nfa, n), 0);
+        case RE_STAR:
+        case RE_PLUS:
+            s = reEmit(nfa, n, RE_SPLIT, -1, next, 0);
+            body = reCompile(nodes, t->a, s, rev, nfa, n);
+            (*nfa)[s].out = body;
+            return t->op == RE_STAR ? s : body;
+        case RE_QUEST:
+            s = reCompile(nodes, t->a, next, rev, nfa, n);
+            return reEmit(nfa, n, RE_SPLIT, s, next, 0);
+        case RE_BEGIN:
+        case RE_END:
+            return reEmit(nfa, n, (t->op == RE_BEGIN) != rev ? RE_BEGIN : RE_END, next, -1, 0);
+    }
+    return next;
+}
+
+// appends the literal bytes node starts with; returns 1 if it is all literal
+int reLiteralPrefix(struct renode* nodes, int node, char* buf, int* len) {
+    struct renode* t = &nodes[node];
+    if (t->op == RE_SET && t->lit >= 0) {
+        buf[(*len)++] = t->lit;
+        return 1;
+    }
+    if (t->op == RE_CAT) {
+        return reLiteralPrefix(nodes, t->a, buf, len) && reLiteralPrefix(nodes, t->b, buf, len);
+    }
+    return t->op == RE_EMPTY;
+}
+
+void reDfaInit(struct redfa* d, struct regex* re, struct restate* nfa, int unanchored) {
+    memset(d, 0, sizeof(*d));
+    d->re = re;
+    d->nfa = nfa;
+    d->unanchored = unanchored;
+    d->start[0] = d->start[1] = d->start[2] = -1;
+}
+
+void reDfaFree(struct redfa* d) {
+    free(d->next);
+    free(d->first);
+    free(d->count);
+    free(d->accept);
+    free(d->lists);
+    free(d->hash);
+    free(d->mark);
+    free(d->stack);
+    free(d->scratch);
+}
+
+void reFree(struct regex* re) {
+    if (re == NULL) return;
+    for (int i = 0; i <= FEMTO_FIND_THREADS; i++) reDfaFree(&re->dfa[i]);
+    reDfaFree(&re->rdfa);
+    free(re->pattern);
+    free(re->prefix);
+    free(re->sets);
+    free(re->fwd);
+    free(re->rev);
+    free(re);
+}
+
+// Compiles pattern, or returns NULL if it is malformed.
+struct regex* reCompilePattern(const char* pattern) {
+    struct regex* re = calloc(1, sizeof(struct regex));
+    if (re == NULL) die("calloc");
+    struct reparse ps = {pattern, re, NULL, 0, 0, 0};
+    int root = reParseAlt(&ps);
+    if (ps.err || *ps.p) {
+        free(ps.nodes);
+        reFree(re);
+        return NULL;
+    }
+
+    re->pattern = strdup(pattern);
+    re->prefix = malloc(strlen(pattern) + 1);
+    if (re->pattern == NULL || re->prefix == NULL) die("malloc");
+    int len = 0;
+    re->literal = reLiteralPrefix(ps.nodes, root, re->prefix, &len);
+    re->prefix[len] = '\0';
+
+    int match = reEmit(&re->fwd, &re->nfwd, RE_MATCH, -1, -1, 0);
+    reEmit(&re->fwd, &re->nfwd, RE_SPLIT, reCompile(ps.nodes, root, match, 0, &re->fwd, &re->nfwd), -1, 0);
+    match = reEmit(&re->rev, &re->nrev, RE_MATCH, -1, -1, 0);
+    reEmit(&re->rev, &re->nrev, RE_SPLIT, reCompile(ps.nodes, root, match, 1, &re->rev, &re->nrev), -1, 0);
+    free(ps.nodes);
+
+    // bytes in exactly the same sets behave alike in every DFA state
+    for (int c = 0; c < 256; c++) {
+        int k = 0;
+        for (; k < re->nclasses; k++) {
+            int r = re->classrep[k], i = 0;
+            while (i < re->nsets && reSetHas(&re->sets[i], c) == reSetHas(&re->sets[i], r)) i++;
+            if (i == re->nsets) break;
+        }
+        if (k == re->nclasses) re->classrep[re->nclasses++] = c;
+        re->classmap[c] = k;
+    }
+    re->classrep[re->nclasses] = RE_EDGE;
+    re->classmap[RE_EDGE] = re->nclasses++;
+
+    for (int i = 0; i <= FEMTO_FIND_THREADS; i++) reDfaInit(&re->dfa[i], re, re->fwd, 1);
+    reDfaInit(&re->rdfa, re, re->rev, 0);
+    return re;
+}
+
+// Adds NFA state s and the states reachable from it without consuming a
+// byte to the scratch list. RE_BEGIN holds only at the edge the scan started
+// from, RE_END only in the RE_EDGE step; until then it waits in the list.
+void reClosure(struct redfa* d, int s, int begin, int end, int* n) {
+    int top = 0;
+    d->stack[top++] = s;
+    while (top) {
+        s = d->stack[--top];
+        if (s < 0 || d->mark[s] == d->gen) continue;
+        d->mark[s] = d->gen;
+        struct restate* q = &d->nfa[s];
+        if (q->op == RE_SPLIT) {
+            d->stack[top++] = q->out1;
+            d->stack[top++] = q->out;
+        } else if (q->op == RE_BEGIN) {
+            if (begin) d->stack[top++] = q->out;
+        } else if (q->op == RE_END && end) {
+            d->stack[top++] = q->out;
+        } else {
+            d->scratch[(*n)++] = s;
+        }
+    }
+}
+
+int reIntCmp(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+unsigned reHashList(const int* list, int n) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < n; i++) h = (h ^ (unsigned)list[i]) * 16777619u;
+    return h;
+}
+
+void reDfaFlush(struct redfa* d) {
+    d->nstates = 0;
+    d->nlists = 0;
+    d->start[0] = d->start[1] = d->start[2] = -1;
+    d->flushes++;
+    memset(d->hash, 0, sizeof(int) * FEMTO_RE_STATES * 2);
+}
+
+// DFA state for the n NFA states in scratch, added if it is new
+int reDfaState(struct redfa* d, int n) {
+    qsort(d->scratch, n, sizeof(int), reIntCmp);
+    unsigned mask = FEMTO_RE_STATES * 2 - 1;
+    unsigned h = reHashList(d->scratch, n) & mask;
+    for (; d->hash[h]; h = (h + 1) & mask) {
+        int s = d->hash[h] - 1;
+        if (d->count[s] == n && memcmp(&d->lists[d->first[s]], d->scratch, sizeof(int) * n) == 0) {
+            return s;
+        }
+    }
+    if (d->nstates == FEMTO_RE_STATES) {
+        reDfaFlush(d);
+        h = reHashList(d->scratch, n) & mask;
+    }
+
+    int s = d->nstates++;
+    if (s == d->cap) {
+        int nc = d->re->nclasses;
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->next = realloc(d->next, sizeof(int) * d->cap * nc);
+        d->first = realloc(d->first, sizeof(int) * d->cap);
+        d->count = realloc(d->count, sizeof(int) * d->cap);
+        d->accept = realloc(d->accept, d->cap);
+        if (!d->next || !d->first || !d->count || !d->accept) die("realloc");
+    }
+    if (d->nlists + n > d->listcap) {
+        d->listcap = (d->nlists + n) * 2;
+        d->lists = realloc(d->lists, sizeof(int) * d->listcap);
+        if (d->lists == NULL) die("realloc");
+    }
+    memset(&d->next[s * d->re->nclasses], 0, sizeof(int) * d->re->nclasses);
+    d->first[s] = d->nlists;
+    d->count[s] = n;
+    memcpy(&d->lists[d->nlists], d->scratch, sizeof(int) * n);
+    d->nlists += n;
+    d->accept[s] = 0;
+    for (int i = 0; i < n; i++) {
+        if (d->nfa[d->scratch[i]].op == RE_MATCH) d->accept[s] = 1;
+    }
+    while (d->hash[h]) h = (h + 1) & mask;
+    d->hash[h] = s + 1;
+    return s;
+}
+
+// start state of a scan from inside the row (0), from its edge (1), or of an
+// empty row, where both edges are at hand (2)
+int reDfaStart(struct redfa* d, int edge) {
+    if (d->hash == NULL) {
+        int nnfa = d->nfa == d->re->fwd ? d->re->nfwd : d->re->nrev;
+        d->hash = calloc(FEMTO_RE_STATES * 2, sizeof(int));
+        d->mark = calloc(nnfa, sizeof(int));
+        d->stack = malloc(sizeof(int) * (nnfa * 2 + 1));
+        d->scratch = malloc(sizeof(int) * nnfa);
+        if (!d->hash || !d->mark || !d->stack || !d->scratch) die("malloc");
+    }
+    if (d->start[edge] < 0) {
+        int n = 0;
+        d->gen++;
+        reClosure(d, d->nfa == d->re->fwd ? d->re->nfwd - 1 : d->re->nrev - 1, edge > 0, edge == 2, &n);
+        d->start[edge] = reDfaState(d, n);
+    }
+    return d->start[edge];
+}
+
+// builds the transition of DFA state s on symbols of class cls
+int reDfaStep(struct redfa* d, int s, int cls) {
+    int sym = d->re->classrep[cls];
+    int n = 0;
+    d->gen++;
+    for (int i = 0; i < d->count[s]; i++) {
+        int k = d->lists[d->first[s] + i];
+        struct restate* q = &d->nfa[k];
+        if (sym == RE_EDGE) {
+            if (q->op == RE_END) reClosure(d, q->out, 0, 1, &n);
+            else if (q->op == RE_MATCH) reClosure(d, k, 0, 1, &n);
+        } else if (q->op == RE_SET && reSetHas(&d->re->sets[q->set], sym)) {
+            reClosure(d, q->out, 0, 0, &n);
+        }
+    }
+    if (d->unanchored) reClosure(d, d->re->nfwd - 1, 0, sym == RE_EDGE, &n);
+    int flushes = d->flushes;
+    int t = reDfaState(d, n);
+    if (flushes == d->flushes) d->next[s * d->re->nclasses + cls] = t + 1;
+    return t;
+}
+
+// Offset just past the earliest ending match in a row of len bytes, among
+// the matches that start at byte from or later, or -1 if there is none.
+int reSearch(struct redfa* d, const char* text, int len, int from) {
+    const int* classmap = d->re->classmap;
+    int nc = d->re->nclasses;
+    int s = reDfaStart(d, len == 0 ? 2 : from == 0);
+    if (len == 0) return d->accept[s] ? 0 : -1;
+    for (int pos = from; pos < len; pos++) {
+        if (d->accept[s]) return pos;
+        int cls = classmap[(unsigned char)text[pos]];
+        int t = d->next[s * nc + cls];
+        s = t ? t - 1 : reDfaStep(d, s, cls);
+    }
+    if (d->accept[s]) return len;
+    int t = d->next[s * nc + classmap[RE_EDGE]];
+    s = t ? t - 1 : reDfaStep(d, s, classmap[RE_EDGE]);
+    return d->accept[s] ? len : -1;
+}
+
+// where the leftmost match ending at offset end starts
+int reMatchStart(struct regex* re, const char* text, int len, int end) {
+    struct redfa* d = &re->rdfa;
+    int nc = re->nclasses;
+    if (len == 0) return 0;
+    int s = reDfaStart(d, end == len);
+    int start = end;
+    for (int pos = end; pos > 0 && d->count[s]; pos--) {
+        int cls = re->classmap[(unsigned char)text[pos - 1]];
+        int t = d->next[s * nc + cls];
+        s = t ? t - 1 : reDfaStep(d, s, cls);
+        if (d->accept[s]) start = pos - 1;
+    }
+    if (start == 0 || !d->count[s]) return start;
+    int t = d->next[s * nc + re->classmap[RE_EDGE]];
+    s = t ? t - 1 : reDfaStep(d, s, re->classmap[RE_EDGE]);
+    return d->accept[s] ? 0 : start;
+}
+
+/*** find ***/
+const char* findMemmemScalar(const char* hay, size_t n, const char* needle,
+        size_t m, size_t i) {
+    for (; i + m <= n; i++) {
+        const char* p = memchr(&hay[i], needle[0], n - m + 1 - i);
+        if (p == NULL) return NULL;
+        i = p - hay;
+        if (hay[i + m - 1] == needle[m - 1] && memcmp(&hay[i + 1], &needle[1], m - 2) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+#ifdef FEMTO_X86
+// Positions whose first and last bytes both match the needle are found 32
+// at a time; only those get a full compare.
+__attribute__((target("avx2")))
+const char* findMemmemAvx2(const char* hay, size_t n, const char* needle, size_t m) {
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&hay[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&hay[i + m - 1]);
+        unsigned mask = _mm256_movemask_epi8(
+                _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&hay[i + bit + 1], &needle[1], m - 2) == 0) return &hay[i + bit];
+            mask &= mask - 1;
+        }
+    }
+    return findMemmemScalar(hay, n, needle, m, i);
+}
+
+__attribute__((target("sse2")))
+const char* findMemmemSse2(const char* hay, size_t n, const char* needle, size_t m) {
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[m - 1]);
+    size_t i = 0;
+    for (; i + m - 1 + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)&hay[i]);
+        __m128i b = _mm_loadu_si128((const __m128i*)&hay[i + m - 1]);
+        unsigned mask = _mm_movemask_epi8(
+                _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(&hay[i + bit + 1], &needle[1], m - 2) == 0) return &hay[i + bit];
+            mask &= mask - 1;
+        }
+    }
+    return findMemmemScalar(hay, n, needle, m, i);
+}
+#endif
+
+// first occurrence of needle in hay, using the widest vector unit available
+const char* findMemmem(const char* hay, size_t n, const char* needle, size_t m) {
+    if (m == 0) return hay;
+    if (m > n) return NULL;
+    if (m == 1) return memchr(hay, needle[0], n);
+#ifdef FEMTO_X86
+    static int avx2 = -1;
+    if (avx2 == -1) avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return findMemmemAvx2(hay, n, needle, m);
+    if (__builtin_cpu_supports("sse2")) return findMemmemSse2(hay, n, needle, m);
+#endif
+    return findMemmemScalar(hay, n, needle, m, 0);
+}
+
+// text of a row for a search worker; the caller has flushed the gap, and the
+// main thread only adds chars to rows that keep their view meanwhile
+const char* findRowText(erow* row) {
+    return row->view ? row->view : row->chars;
+}
+
+// A search worker's place in the rows. Packed leaves are unpacked into the
+// worker's own buffers, with rows standing in for theirs that are views of
+// the text there: the main thread loads and evicts its copies meanwhile,
+// though packed leaves themselves don't change while a search runs. Two are
+// kept so that a span of views can look past the end of a leaf.
+struct findpos {
+    struct rowpos pos;
+    rnode* leaf[2];
+    char* text[2];
+    size_t cap[2];
+    int last; // the one used last
+    erow rows[2][FEMTO_LEAF_ROWS];
+};
+
+void findPosInit(struct findpos* fp) {
+    fp->pos.leaf = NULL;
+    fp->leaf[0] = fp->leaf[1] = NULL;
+    fp->text[0] = fp->text[1] = NULL;
+    fp->cap[0] = fp->cap[1] = 0;
+    fp->last = 0;
+}
+
+erow* findRowSeek(struct findpos* fp, int at) {
+    erow* row = editorRowSeek(&fp->pos, at);
+    rnode* leaf = fp->pos.leaf;
+    if (leaf->packed == NULL) return row;
+    int k = leaf == fp->leaf[0] ? 0 : leaf == fp->leaf[1] ? 1 : !fp->last;
+    if (fp->leaf[k] != leaf) {
+        if (fp->cap[k] < leaf->rawsize) {
+            fp->text[k] = realloc(fp->text[k], leaf->rawsize);
+            if (fp->text[k] == NULL) die("realloc");
+            fp->cap[k] = leaf->rawsize;
+        }
+        lzDecompress(leaf->packed, fp->text[k], leaf->rawsize);
+        const char* p = fp->text[k];
+        for (int i = 0; i < leaf->n; i++) {
+            fp->rows[k][i].size = leaf->rows[i].size;
+            fp->rows[k][i].chars = NULL;
+            fp->rows[k][i].view = p;
+            p += leaf->rows[i].size + 1;
+        }
+        fp->leaf[k] = leaf;
+    }
+    fp->last = k;
+    return &fp->rows[k][at - fp->pos.first];
+}
+
+void findPosFree(struct findpos* fp) {
+    free(fp->text[0]);
+    free(fp->text[1]);
+}
+
+// Calls hit(arg, row, offset) for the first occurrence of query in each row
+// of [from, to), in order, until hit returns 0. Returns the row after the
+// last one searched. Rows that are adjacent views of the file mapping, or of
+// a packed leaf, are searched as one span; the query holds no line breaks,
+// so a match never straddles two rows. Safe to run from a worker while the
+// prompt is up.
+int editorFindScan(const char* query, int from, int to,
+        int (*hit)(void*, int, int), void* arg) {
+    size_t m = strlen(query);
+    struct findpos pos;
+    findPosInit(&pos);
+    int i = from;
+
+    while (i < to) {
+        erow* row = findRowSeek(&pos, i);
+        const char* text = findRowText(row);
+        const char* end = text + row->size;
+        int j = i + 1;
+        if (row->view) {
+            for (; j < to; j++) {
+                erow* next = findRowSeek(&pos, j);
+                if (next->view == NULL || next->view < end || next->view > end + 2) break;
+                end = next->view + next->size;
+            }
+        }
+
+        const char* p = text;
+        int k = i;
+        while ((p = findMemmem(p, end - p, query, m)) != NULL) {
+            while (p >= text + row->size) {
+                row = findRowSeek(&pos, ++k);
+                text = row->view;
+            }
+            if (!hit(arg, k, p - text)) {
+                findPosFree(&pos);
+                return k + 1;
+            }
+            if (++k == j) break;
+            row = findRowSeek(&pos, k);
+            p = text = row->view;
+        }
+        i = j;
+    }
+    findPosFree(&pos);
+    return to;
 }
 
-void editorRowDelChar(erow* row, int at) {
-    if (at < 0 || at >= row->size) return;
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.sincemodif++;
+int editorFindCollectHit(void* arg, int row, int off) {
+    struct findchunk* chunk = arg;
+    (void)off;
+    if (chunk->n == chunk->cap) {
+        chunk->cap = chunk->cap ? chunk->cap * 2 : 64;
+        chunk->rows = realloc(chunk->rows, sizeof(int) * chunk->cap);
+        if (chunk->rows == NULL) die("realloc");
+    }
+    chunk->rows[chunk->n++] = row;
+    return 1;
 }
 
-/*** editor operations ***/
+struct findregex {
+    struct redfa* dfa;
+    struct findchunk* chunk;
+    struct findpos pos;
+};
 
-void editorInsertChar(int c) {
-    if (E.cursorY == E.nrows) {
-        editorInsertRow(E.nrows, "", 0);
+// a row holding the literal prefix of the regex at off; a match can only
+// start there or further on
+int editorFindRegexHit(void* arg, int at, int off) {
+    struct findregex* fr = arg;
+    erow* row = findRowSeek(&fr->pos, at);
+    if (fr->dfa->re->literal || reSearch(fr->dfa, findRowText(row), row->size, off) >= 0) {
+        editorFindCollectHit(fr->chunk, at, off);
     }
-    editorRowInsertChar(&E.row[E.cursorY], E.cursorX, c);
-    E.cursorX++;
+    return 1;
 }
 
-void editorInsertNewline() {
-    if (E.cursorX == 0) {
-        editorInsertRow(E.cursorY, "", 0);
-    } else {
-        erow* row = &E.row[E.cursorY];
-        editorInsertRow(E.cursorY + 1, &row->chars[E.cursorX], row->size - E.cursorX);
-        row = &E.row[E.cursorY];
-        row->size = E.cursorX;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+// Collects the matches in chunk c, checking only the rows of cand if given.
+// A regex is run on the rows holding its literal prefix, or on every row if
+// it has none, with the DFA cache of search thread id.
+void editorFindChunk(const char* query, struct regex* re, int id, int c,
+        struct findchunk* chunk, struct findchunk* cand) {
+    int from = c * FEMTO_FIND_CHUNK;
+    int to = from + FEMTO_FIND_CHUNK < E.nrows ? from + FEMTO_FIND_CHUNK : E.nrows;
+    if (re) {
+        struct findregex fr;
+        fr.dfa = &re->dfa[id];
+        fr.chunk = chunk;
+        findPosInit(&fr.pos);
+        if (re->prefix[0]) {
+            editorFindScan(re->prefix, from, to, editorFindRegexHit, &fr);
+        } else {
+            for (int i = from; i < to; i++) editorFindRegexHit(&fr, i, 0);
+        }
+        findPosFree(&fr.pos);
+        return;
     }
-    E.cursorY++;
-    E.cursorX = 0;
+    if (cand == NULL) {
+        editorFindScan(query, from, to, editorFindCollectHit, chunk);
+        return;
+    }
+    size_t m = strlen(query);
+    struct findpos pos;
+    findPosInit(&pos);
+    for (int i = 0; i < cand->n; i++) {
+        erow* row = findRowSeek(&pos, cand->rows[i]);
+        if (findMemmem(findRowText(row), row->size, query, m)) {
+            editorFindCollectHit(chunk, cand->rows[i], 0);
+        }
+    }
+    findPosFree(&pos);
 }
 
-void editorDelChar() {
-    // return immediately if cursor is past end of the file
-    if (E.cursorY == E.nrows) return;
-    if (E.cursorX == 0 && E.cursorY == 0) return;
+void* editorFindWorker(void* arg) {
+    int id = (int)(intptr_t)arg;
+    pthread_mutex_lock(&E.find.lock);
+    while (1) {
+        if (E.find.next == E.find.nchunks) {
+            pthread_cond_wait(&E.find.work, &E.find.lock);
+            continue;
+        }
+        int c = E.find.next++;
+        const char* query = E.find.query;
+        struct regex* re = E.find.re;
+        struct findchunk* chunk = &E.find.chunks[c];
+        struct findchunk* cand = E.find.prev && E.find.prev[c].done ? &E.find.prev[c] : NULL;
+        E.find.busy++;
+        pthread_mutex_unlock(&E.find.lock);
 
-    erow* row = &E.row[E.cursorY];
-    if (E.cursorX > 0) {
-        editorRowDelChar(row, E.cursorX - 1);
-        E.cursorX--;
-    } else {
-        E.cursorX = E.row[E.cursorY - 1].size;
-        editorRowAppendString(&E.row[E.cursorY - 1], row->chars, row->size);
-        editorDelRow(E.cursorY);
-        E.cursorY--;
+        editorFindChunk(query, re, id, c, chunk, cand);
+
+        pthread_mutex_lock(&E.find.lock);
+        chunk->done = 1;
+        E.find.done++;
+        E.find.matches += chunk->n;
+        E.find.busy--;
+        pthread_cond_broadcast(&E.find.idle);
+        editorWake();
     }
+    return NULL;
 }
 
+void findFreeChunks(struct findchunk* chunks, int n) {
+    if (chunks == NULL) return;
+    for (int i = 0; i < n; i++) free(chunks[i].rows);
+    free(chunks);
+}
 
-/*** file io ***/
-char* editorRowsToString(int* buflen) {
-    int totalLen = 0;
-    for (int i = 0; i < E.nrows; i++) {
-       totalLen += E.row[i].size + 1;
-    }
-    *buflen = totalLen;
+// stops handing out chunks and waits for the workers to leave theirs; the
+// caller holds the lock
+void editorFindHalt() {
+    E.find.next = E.find.nchunks;
+    while (E.find.busy) pthread_cond_wait(&E.find.idle, &E.find.lock);
+}
 
-    char* buf = malloc(totalLen);
-    char* p = buf;
+void editorFindStop() {
+    if (E.find.nthreads == 0) return;
+    pthread_mutex_lock(&E.find.lock);
+    editorFindHalt();
+    findFreeChunks(E.find.chunks, E.find.nchunks);
+    findFreeChunks(E.find.prev, E.find.nchunks);
+    free(E.find.query);
+    E.find.query = NULL;
+    E.find.re = NULL;
+    E.find.bad = 0;
+    E.find.chunks = E.find.prev = NULL;
+    E.find.nchunks = E.find.next = E.find.done = E.find.matches = 0;
+    E.find.current = -1;
+    E.find.pending = 0;
+    pthread_mutex_unlock(&E.find.lock);
+}
 
-    for (int i = 0; i < E.nrows; i++) {
-        memcpy(p, E.row[i].chars, E.row[i].size);
-        p += E.row[i].size;
-        *p = '\n';
-        p++;
+void editorFindSpawn() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > FEMTO_FIND_THREADS) n = FEMTO_FIND_THREADS;
+    pthread_mutex_init(&E.find.lock, NULL);
+    pthread_cond_init(&E.find.work, NULL);
+    pthread_cond_init(&E.find.idle, NULL);
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&E.find.threads[i], NULL, editorFindWorker, (void*)(intptr_t)i) != 0) break;
+        E.find.nthreads++;
     }
-
-    return buf;
+    if (E.find.nthreads == 0) die("pthread_create");
 }
 
-void editorOpen(char* filename) {
-    free(E.filename);
-    E.filename = strdup(filename);
+// Compiled form of a regex query. Patterns compiled recently, with their DFA
+// caches, are kept so that the prompt edits that go back to one, like
+// deleting a character just typed, don't compile it again.
+struct regex* editorFindRegex(const char* pattern) {
+    int i = 0;
+    while (i < FEMTO_RE_CACHE && E.find.recache[i] && strcmp(E.find.recache[i]->pattern, pattern)) i++;
+    struct regex* re;
+    if (i < FEMTO_RE_CACHE && E.find.recache[i]) {
+        re = E.find.recache[i];
+    } else {
+        re = reCompilePattern(pattern);
+        if (re == NULL) return NULL;
+        i = FEMTO_RE_CACHE - 1;
+        reFree(E.find.recache[i]);
+    }
+    memmove(&E.find.recache[1], &E.find.recache[0], sizeof(struct regex*) * i);
+    E.find.recache[0] = re;
+    return re;
+}
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+// Starts searching the buffer for query in the background. If the previous
+// query is part of the new one, each chunk it finished (or had candidates
+// for) only has its matches checked again; that does not hold for regexes.
+void editorFindStart(char* query) {
+    if (E.find.query && strcmp(query, E.find.query) == 0 && (E.find.re != NULL) == E.find.regex) return;
+    if (E.find.nthreads == 0) editorFindSpawn();
+    editorGapFlush();
 
-    char* line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        // strips last character if it is carriage return or newline
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r')) {
-            linelen--;
+    pthread_mutex_lock(&E.find.lock);
+    editorFindHalt();
+    struct regex* re = NULL;
+    if (E.find.regex && (re = editorFindRegex(query)) == NULL) {
+        pthread_mutex_unlock(&E.find.lock);
+        editorFindStop();
+        E.find.bad = 1;
+        return;
+    }
+    int n = (E.nrows + FEMTO_FIND_CHUNK - 1) / FEMTO_FIND_CHUNK;
+    if (E.find.query && !E.find.re && !re && strstr(query, E.find.query) && n == E.find.nchunks) {
+        for (int c = 0; E.find.prev && c < n; c++) {
+            if (!E.find.chunks[c].done && E.find.prev[c].done) {
+                struct findchunk t = E.find.chunks[c];
+                E.find.chunks[c] = E.find.prev[c];
+                E.find.prev[c] = t;
+            }
         }
-        editorInsertRow(E.nrows, line, linelen);
+        findFreeChunks(E.find.prev, E.find.nchunks);
+        E.find.prev = E.find.chunks;
+    } else {
+        findFreeChunks(E.find.chunks, E.find.nchunks);
+        findFreeChunks(E.find.prev, E.find.nchunks);
+        E.find.prev = NULL;
     }
-    free(line);
-    fclose(fp);
-    E.sincemodif = 0;
+    E.find.chunks = calloc(n ? n : 1, sizeof(struct findchunk));
+    if (E.find.chunks == NULL) die("calloc");
+    free(E.find.query);
+    E.find.query = strdup(query);
+    E.find.re = re;
+    E.find.bad = 0;
+    E.find.nchunks = n;
+    E.find.next = E.find.done = E.find.matches = 0;
+    pthread_cond_broadcast(&E.find.work);
+    pthread_mutex_unlock(&E.find.lock);
 }
 
-void editorSave() {
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+// index of the first match in chunk after row
+int editorFindIndex(struct findchunk* chunk, int row) {
+    int lo = 0, hi = chunk->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (chunk->rows[mid] <= row) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
+}
 
-    int len;
-    char* buf = editorRowsToString(&len);
-
-    // 0644 is std permissions you usually wants for text file
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    if  (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                E.sincemodif = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
+// Row of the next match after `current` going in direction, wrapping around,
+// or -1 if there is none. If a chunk on the way is still being searched it
+// either waits for it or returns -2.
+int editorFindNext(int current, int direction, int wait) {
+    pthread_mutex_lock(&E.find.lock);
+    int n = E.find.nchunks;
+    int c0 = current < 0 ? 0 : current / FEMTO_FIND_CHUNK;
+    int found = -1;
+    for (int k = 0; n && k <= n; k++) {
+        struct findchunk* chunk = &E.find.chunks[(c0 + direction * k + n) % n];
+        while (wait && !chunk->done) pthread_cond_wait(&E.find.idle, &E.find.lock);
+        if (!chunk->done) {
+            found = -2;
+            break;
+        }
+        int i = direction == 1 ? 0 : chunk->n - 1;
+        if (k == 0 && current >= 0) {
+            i = editorFindIndex(chunk, current);
+            if (direction == -1) {
+                i--;
+                if (i >= 0 && chunk->rows[i] == current) i--;
             }
         }
-        close(fd);
+        if (i >= 0 && i < chunk->n) {
+            found = chunk->rows[i];
+            break;
+        }
     }
+    pthread_mutex_unlock(&E.find.lock);
+    return found;
+}
 
-    free(buf);
+// "n of m matches" for the status bar, with n only once every chunk up to
+// the current match is done and m marked with a + while more may come
+int editorFindStatus(char* buf, size_t bufsize) {
+    pthread_mutex_lock(&E.find.lock);
+    int ord = 0;
+    if (E.find.current >= 0) {
+        int c = E.find.current / FEMTO_FIND_CHUNK;
+        for (int i = 0; i <= c && ord >= 0; i++) {
+            if (!E.find.chunks[i].done) ord = -1;
+            else if (i < c) ord += E.find.chunks[i].n;
+        }
+        if (ord >= 0) ord += editorFindIndex(&E.find.chunks[c], E.find.current);
+    }
+    const char* more = E.find.done < E.find.nchunks ? "+" : "";
+    const char* kind = E.find.re ? "regex " : "";
+    int len;
+    if (E.find.bad) {
+        len = snprintf(buf, bufsize, "invalid regex");
+    } else if (ord > 0) {
+        len = snprintf(buf, bufsize, "%d of %d%s %smatches", ord, E.find.matches, more, kind);
+    } else {
+        len = snprintf(buf, bufsize, "%d%s %smatches", E.find.matches, more, kind);
+    }
+    pthread_mutex_unlock(&E.find.lock);
+    return len;
+}
 
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+// Moves the cursor to the match in row current, if any. The row is read
+// where it is, so that no packed leaf is unpacked for good while the
+// workers may be reading it. A regex that is just literal text is looked
+// for as its unescaped prefix.
+void editorFindJump(char* query, int current) {
+    E.find.pending = 0;
+    if (current < 0) return;
+    erow* row = editorRowSeek(&E.pos, current);
+    const char* text = editorRowText(row);
+    struct regex* re = E.find.re;
+    int at;
+    if (re && !re->literal) {
+        int end = reSearch(&re->dfa[FEMTO_FIND_THREADS], text, row->size, 0);
+        if (end < 0) return;
+        at = reMatchStart(re, text, row->size, end);
+    } else {
+        const char* lit = re ? re->prefix : query;
+        const char* p = findMemmem(text, row->size, lit, strlen(lit));
+        if (p == NULL) return;
+        at = p - text;
+    }
+    E.find.current = current;
+    E.cursorY = current;
+    E.cursorX = at;
+    E.rowoff = E.wrap ? E.root->nlines : E.nrows;
 }
 
-/*** find ***/
 void editorFindCallback(char* query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
-
+    if (key == '\r' && E.find.pending) {
+        // accepted before the match was known
+        editorFindJump(query, editorFindNext(E.find.current, E.find.pending, 1));
+    }
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        editorFindStop();
         return;
+    } else if (key == WAKE_KEY) {
+        if (!E.find.pending) return;
     } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
+        E.find.pending = 1;
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
+        E.find.pending = -1;
     } else {
-        last_match = -1;
-        direction = 1;
-    }
-
-    if (last_match == -1) direction = 1;
-    int current = last_match;
-
-    for (int i = 0; i < E.nrows; i++) {
-        current += direction;
-        if (current == -1) current = E.nrows - 1;
-        else if (current == E.nrows) current = 0;
-
-        erow* row = &E.row[current];
-        char* match = strstr(row->render, query);
-        if (match) {
-            last_match = current;
-            E.cursorY = current;
-
-            E.cursorY = current;
-            E.cursorX = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.nrows;
-            break;
+        if (key == CTRL_KEY('r')) E.find.regex = !E.find.regex;
+        E.find.current = -1;
+        if (query[0] == '\0') {
+            editorFindStop();
+            return;
         }
+        editorFindStart(query);
     }
+    if (E.find.query == NULL) return;
+
+    if (E.find.current == -1) E.find.pending = 1;
+    int current = editorFindNext(E.find.current, E.find.pending, 0);
+    if (current == -2) return; // tried again as chunks finish
+    editorFindJump(query, current);
 }
 
 void editorFind() {
@@ -469,7 +4968,8 @@ void editorFind() {
     int coff = E.coloff;
     int roff = E.rowoff;
 
-    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    E.find.current = -1;
+    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback);
 
     if (query) {
         free(query);
@@ -502,11 +5002,327 @@ void abFree(struct abuf* ab) {
     free(ab->b);
 }
 
+/*** screen frame ***/
+void frameResize(struct frame* f, int rows, int cols) {
+    f->rows = rows;
+    f->cols = cols;
+    f->cells = realloc(f->cells, rows * cols * sizeof(uint64_t));
+    f->attrs = realloc(f->attrs, rows * cols);
+    if (rows * cols > 0 && (f->cells == NULL || f->attrs == NULL)) die("realloc");
+}
+
+void frameBlank(uint64_t* cells, int n) {
+    for (int i = 0; i < n; i++) cells[i] = ' ';
+}
+
+void frameClear(struct frame* f) {
+    frameBlank(f->cells, f->rows * f->cols);
+    memset(f->attrs, FEMTO_ATTR_NORMAL, f->rows * f->cols);
+    f->y = f->x = 0;
+    f->attr = FEMTO_ATTR_NORMAL;
+}
+
+void frameMove(struct frame* f, int y, int x) {
+    f->y = y;
+    f->x = x;
+}
+
+// Writes len bytes of UTF-8 text at the pen, a cell per cluster and two for
+// a wide one, clipped to the right edge of the frame. attrs has the attribute
+// of each byte, or is NULL for the pen's. The first skip columns of the text
+// are left out; a wide character cut by either edge shows as a space.
+void framePutsText(struct frame* f, const char* s, const unsigned char* attrs, int len, int skip) {
+    if (f->y < 0 || f->y >= f->rows) return;
+    uint64_t* cells = &f->cells[f->y * f->cols];
+    unsigned char* cattrs = &f->attrs[f->y * f->cols];
+    int col = 0;
+    for (int i = 0; i < len && f->x < f->cols;) {
+        int n = 1, w = 1;
+        uint64_t cell = (unsigned char)s[i];
+        if ((cell & 0x80) || (i + 1 < len && (s[i + 1] & 0x80))) {
+            n = utf8Cluster(&s[i], len - i, &w);
+            // a cell holds 8 bytes; marks past them are left out whole
+            int end = n;
+            if (end > 8) {
+                end = 8;
+                while (end > 1 && (s[i + end] & 0xc0) == 0x80) end--;
+            }
+            cell = 0;
+            for (int k = end - 1; k >= 0; k--) cell = cell << 8 | (unsigned char)s[i + k];
+        }
+        unsigned char attr = attrs ? attrs[i] : f->attr;
+        if (w > 0 && col + w > skip) {
+            int cut = col < skip || (w == 2 && f->x + 1 == f->cols);
+            cells[f->x] = cut ? ' ' : cell;
+            cattrs[f->x++] = attr;
+            if (w == 2 && !cut) {
+                cells[f->x] = 0;
+                cattrs[f->x++] = attr;
+            }
+        }
+        col += w;
+        i += n;
+    }
+}
+
+// framePutsText for text known to be ASCII: a cell per byte
+void framePutsAscii(struct frame* f, const char* s, const unsigned char* attrs, int len) {
+    if (f->y < 0 || f->y >= f->rows) return;
+    if (len > f->cols - f->x) len = f->cols - f->x;
+    uint64_t* cells = &f->cells[f->y * f->cols + f->x];
+    unsigned char* cattrs = &f->attrs[f->y * f->cols + f->x];
+    for (int i = 0; i < len; i++) cells[i] = (unsigned char)s[i];
+    if (attrs) memcpy(cattrs, attrs, len);
+    else memset(cattrs, f->attr, len);
+    f->x += len;
+}
+
+void framePuts(struct frame* f, const char* s, int len) {
+    framePutsText(f, s, NULL, len, 0);
+}
+
+void editorInvalidateScreen() {
+    E.frontvalid = 0;
+}
+
+void abAppendAttr(struct abuf* ab, unsigned char attr) {
+    static const char* sgr[] = {
+        [FEMTO_ATTR_NORMAL] = "\x1b[m",
+        [FEMTO_ATTR_INVERSE] = "\x1b[0;7m",
+        [FEMTO_ATTR_COMMENT] = "\x1b[0;36m",
+        [FEMTO_ATTR_KEYWORD] = "\x1b[0;33m",
+        [FEMTO_ATTR_TYPE] = "\x1b[0;32m",
+        [FEMTO_ATTR_STRING] = "\x1b[0;35m",
+        [FEMTO_ATTR_NUMBER] = "\x1b[0;31m",
+    };
+    abAppend(ab, sgr[attr], strlen(sgr[attr]));
+}
+
+// Moves the unchanged text rows of the front frame with a terminal scroll
+// region when only E.rowoff changed, so the diff only has to fill the rows
+// that scrolled into view.
+void editorFlushScroll(struct abuf* ab) {
+    int d = E.rowoff - E.frontrowoff;
+    if (d == 0 || E.coloff != E.frontcoloff || abs(d) >= E.screenRows) return;
+
+    char buf[32];
+    abAppend(ab, "\x1b[m", 3);
+    snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenRows);
+    abAppend(ab, buf, strlen(buf));
+    if (d > 0) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenRows);
+        abAppend(ab, buf, strlen(buf));
+        for (int i = 0; i < d; i++) abAppend(ab, "\n", 1);
+    } else {
+        abAppend(ab, "\x1b[H", 3);
+        for (int i = 0; i < -d; i++) abAppend(ab, "\x1bM", 2);
+    }
+    abAppend(ab, "\x1b[r", 3);
+
+    struct frame* f = &E.front;
+    int keep = (E.screenRows - abs(d)) * f->cols;
+    int from = d > 0 ? d * f->cols : 0;
+    int to = d > 0 ? 0 : -d * f->cols;
+    int blank = d > 0 ? keep : 0;
+    memmove(&f->cells[to], &f->cells[from], keep * sizeof(uint64_t));
+    memmove(&f->attrs[to], &f->attrs[from], keep);
+    frameBlank(&f->cells[blank], abs(d) * f->cols);
+    memset(&f->attrs[blank], FEMTO_ATTR_NORMAL, abs(d) * f->cols);
+}
+
+// emits the cells of the back frame that differ from the front frame
+void editorFlushFrame(struct abuf* ab) {
+    struct frame* back = &E.back;
+    struct frame* front = &E.front;
+    int cols = back->cols;
+
+    if (!E.frontvalid || front->rows != back->rows || front->cols != cols) {
+        frameResize(front, back->rows, cols);
+        frameClear(front);
+        abAppend(ab, "\x1b[m\x1b[2J", 7);
+        E.frontvalid = 1;
+    } else {
+        editorFlushScroll(ab);
+    }
+    E.frontrowoff = E.rowoff;
+    E.frontcoloff = E.coloff;
+
+    int attr = -1; // unknown until the first cell is written
+    for (int y = 0; y < back->rows; y++) {
+        uint64_t* bc = &back->cells[y * cols];
+        unsigned char* ba = &back->attrs[y * cols];
+        uint64_t* fc = &front->cells[y * cols];
+        unsigned char* fa = &front->attrs[y * cols];
+
+        // cells from blankfrom on are plain spaces and can be erased with \x1b[K
+        int blankfrom = cols;
+        while (blankfrom > 0 && bc[blankfrom - 1] == ' ' &&
+                ba[blankfrom - 1] == FEMTO_ATTR_NORMAL) blankfrom--;
+
+        int x = 0;
+        while (x < cols) {
+            while (x < cols && bc[x] == fc[x] && ba[x] == fa[x]) x++;
+            if (x == cols) break;
+
+            int end = x + 1, same = 0;
+            for (int i = end; i < cols && same < FEMTO_DIFF_GAP; i++) {
+                if (bc[i] == fc[i] && ba[i] == fa[i]) {
+                    same++;
+                } else {
+                    end = i + 1;
+                    same = 0;
+                }
+            }
+            // a wide character is written whole, and so is one being overwritten
+            while (x > 0 && (bc[x] == 0 || fc[x] == 0)) x--;
+            while (end < cols && (bc[end] == 0 || fc[end] == 0)) end++;
+            int erase = end > blankfrom;
+            if (erase) end = blankfrom;
+
+            char buf[32];
+            snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
+            abAppend(ab, buf, strlen(buf));
+            // the bytes of the cells are gathered so each run is one append
+            char text[256];
+            int n = 0;
+            for (int i = x; i < end; i++) {
+                if (ba[i] != attr || n > (int)sizeof(text) - 8) {
+                    abAppend(ab, text, n);
+                    n = 0;
+                }
+                if (ba[i] != attr) {
+                    attr = ba[i];
+                    abAppendAttr(ab, attr);
+                }
+                for (uint64_t c = bc[i]; c; c >>= 8) text[n++] = c & 0xff;
+            }
+            abAppend(ab, text, n);
+            if (erase) {
+                if (attr != FEMTO_ATTR_NORMAL) {
+                    attr = FEMTO_ATTR_NORMAL;
+                    abAppendAttr(ab, attr);
+                }
+                abAppend(ab, "\x1b[K", 3);
+                end = cols;
+            }
+            memcpy(&fc[x], &bc[x], (end - x) * sizeof(uint64_t));
+            memcpy(&fa[x], &ba[x], end - x);
+            x = end;
+        }
+    }
+    if (attr != FEMTO_ATTR_NORMAL) abAppendAttr(ab, FEMTO_ATTR_NORMAL);
+}
+
+/*** profiling ***/
+int histBucket(long long v) {
+    if (v < 16) return v < 0 ? 0 : (int)v;
+    int e = 4;
+    while (v >> (e + 1)) e++;
+    return 16 + (e - 4) * 8 + (int)((v >> (e - 3)) & 7);
+}
+
+// smallest value that falls in bucket b
+long long histBucketLow(int b) {
+    if (b < 16) return b;
+    int e = (b - 16) / 8 + 4;
+    return (long long)(8 + (b - 16) % 8) << (e - 3);
+}
+
+void histAdd(struct histogram* h, long long v) {
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+    h->bucket[histBucket(v)]++;
+}
+
+// the value a fraction p of the samples are at or below, rounded up to the
+// top of its bucket
+long long histPercentile(struct histogram* h, double p) {
+    long long want = (long long)(p * h->count + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int b = 0; b < FEMTO_HIST_BUCKETS; b++) {
+        seen += h->bucket[b];
+        if (seen >= want) {
+            long long high = b + 1 < FEMTO_HIST_BUCKETS ? histBucketLow(b + 1) - 1 : h->max;
+            return high < h->max ? high : h->max;
+        }
+    }
+    return h->max;
+}
+
+// records the phases of a frame drawn from start; it was built by drawn
+void editorProfileFrame(long long start, long long drawn, size_t bytes) {
+    struct histogram* h = E.prof.hist;
+    long long now = editorNowNs();
+    histAdd(&h[PROF_RENDER], drawn - start);
+    histAdd(&h[PROF_WRITE], now - drawn);
+    histAdd(&h[PROF_BYTES], bytes);
+    // frames drawn only for a wake or a timer are not key latency
+    if (E.prof.ready) histAdd(&h[PROF_KEY], now - E.prof.ready);
+    // keys a prompt left in the ring are timed from here
+    E.prof.ready = E.in.head != E.in.tail ? now : 0;
+    E.prof.frames++;
+}
+
+// key latency shown in the status bar
+int editorProfileString(char* buf, size_t bufsize) {
+    struct histogram* h = &E.prof.hist[PROF_KEY];
+    return snprintf(buf, bufsize, " | key p50 %.2fms p99 %.2fms",
+            histPercentile(h, 0.5) / 1e6, histPercentile(h, 0.99) / 1e6);
+}
+
+// Writes a summary line per phase, then every bucket that has samples so
+// the histograms can be plotted or merged.
+void editorProfileReport() {
+    static const char* names[PROF_PHASES] = {"parse", "edit", "render", "write", "key", "bytes"};
+    static const double at[] = {0.5, 0.9, 0.99, 0.999};
+    FILE* fp = fopen(E.prof.path, "w");
+    if (fp == NULL) return;
+
+    fprintf(fp, "# femto key latency in us, bytes per frame; %lld frames\n", E.prof.frames);
+    fprintf(fp, "%-6s %10s %10s %10s %10s %10s %10s %10s\n",
+            "phase", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (int i = 0; i < PROF_PHASES; i++) {
+        struct histogram* h = &E.prof.hist[i];
+        double unit = i == PROF_BYTES ? 1 : 1000;
+        fprintf(fp, "%-6s %10lld %10.1f", names[i], h->count, h->count ? h->sum / unit / h->count : 0);
+        for (int k = 0; k < 4; k++) fprintf(fp, " %10.1f", histPercentile(h, at[k]) / unit);
+        fprintf(fp, " %10.1f\n", h->max / unit);
+    }
+
+    fprintf(fp, "\n# phase, bucket from, bucket to (ns or bytes), samples\n");
+    for (int i = 0; i < PROF_PHASES; i++) {
+        struct histogram* h = &E.prof.hist[i];
+        for (int b = 0; b < FEMTO_HIST_BUCKETS; b++) {
+            if (h->bucket[b] == 0) continue;
+            fprintf(fp, "%s %lld %lld %lld\n", names[i], histBucketLow(b),
+                    b + 1 < FEMTO_HIST_BUCKETS ? histBucketLow(b + 1) - 1 : h->max, h->bucket[b]);
+        }
+    }
+    fclose(fp);
+}
+
+// starts timing keys; the report is written to path when femto exits
+void editorProfileStart(const char* path) {
+    if (path == NULL || *path == '\0') return;
+    E.prof.path = path;
+    atexit(editorProfileReport);
+}
+
 /*** output ***/
 void editorScroll() {
     E.rx = 0;
     if (E.cursorY < E.nrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cursorY], E.cursorX);
+        E.rx = editorRowCxToRx(editorRowSeek(&E.pos, E.cursorY), E.cursorX);
+    }
+    if (E.wrap) {
+        int col;
+        E.ry = editorWrapCursor(&col);
+        E.rx = col; // the column on its screen line
+        if (E.ry < E.rowoff) E.rowoff = E.ry;
+        if (E.ry >= E.rowoff + E.screenRows) E.rowoff = E.ry - E.screenRows + 1;
+        E.coloff = 0;
+        return;
     }
 
     if (E.cursorY < E.rowoff) {
@@ -523,11 +5339,14 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuf* ab) {
-    for (int y = 0; y < E.screenRows; y++) {
-        int filerow = y + E.rowoff;
+void editorDrawRows(struct frame* f) {
+    // while soft-wrapping, sub is the line of filerow that screen row y shows
+    int sub = 0;
+    int filerow = E.wrap ? rowTreeFindLine(E.rowoff, &sub) : E.rowoff;
+    for (int y = 0; y < E.screenRows; y++, filerow++) {
+        frameMove(f, y, 0);
         if (filerow >= E.nrows) { //drawing row before or after end of text buffer
-            if (E.nrows == 0 && y == E.screenRows / 3) {
+            if (E.nrows == 0 && !E.load && y == E.screenRows / 3) {
                 char greeting[80];
                 int greetinglen = snprintf(greeting, sizeof(greeting), " Femto by Anirudh Canumalla -- Version: %s", FEMTO_VERS);
                 if (greetinglen > E.screenCols) greetinglen = E.screenCols;
@@ -535,79 +5354,164 @@ void editorDrawRows(struct abuf* ab) {
                 // length from that
                 int padding = (E.screenCols - greetinglen) / 2;
                 if (padding) {
-                    abAppend(ab, "~", 1);
+                    framePuts(f, "~", 1);
                     padding--;
                 }
-                while (padding--) abAppend(ab, " ", 1);
-                abAppend(ab, greeting, greetinglen);
+                frameMove(f, y, f->x + padding);
+                framePuts(f, greeting, greetinglen);
             } else {
-                abAppend(ab, "~", 1);
+                framePuts(f, "~", 1);
             }
         } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
-            if (len > E.screenCols) len = E.screenCols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
+            erow* row = editorRowSeek(&E.pos, filerow);
+            struct renderslot* s = editorRowRender(row);
+            const unsigned char* hl = E.hl.syntax ? editorHlRow(filerow, row, s) : NULL;
+            int skip = E.wrap ? sub * E.screenCols : E.coloff;
+            if (row->ascii == ROW_ASCII) {
+                // one byte per column: start at skip and stop at the edge
+                int len = s->rsize - skip;
+                if (len < 0) len = 0;
+                if (len > E.screenCols) len = E.screenCols;
+                framePutsAscii(f, &s->render[skip], hl ? &hl[skip] : NULL, len);
+            } else if (E.wrap) {
+                // from the character the line starts with, which may be a
+                // wide one that did not fit on the line before
+                int at;
+                wrapWalk(s->render, s->rsize, s->rsize, skip, &at);
+                framePutsText(f, &s->render[at], hl ? &hl[at] : NULL, s->rsize - at, 0);
+            } else {
+                framePutsText(f, s->render, hl, s->rsize, skip);
+            }
+            if (E.wrap && ++sub < rowWrapLines(rowTreeWidth(filerow))) {
+                filerow--; // the row goes on
+            } else {
+                sub = 0;
+            }
         }
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
     }
 }
 
-void editorDrawStatusBar(struct abuf* ab) {
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
+// writes a byte count as e.g. "12.3M"
+void editorFormatSize(char* buf, size_t bufsize, double bytes) {
+    const char* units = "BKMGT";
+    while (bytes >= 1024 && units[1]) {
+        bytes /= 1024;
+        units++;
+    }
+    snprintf(buf, bufsize, *units == 'B' ? "%.0f%c" : "%.1f%c", bytes, *units);
+}
+
+// Row memory counters shown in the status bar when toggled with Ctrl-T: the
+// row text held as it is, and that of packed leaves, compressed and not.
+int editorStatsString(char* buf, size_t bufsize) {
+    size_t total = E.mem.chunkbytes + E.mem.largebytes + E.mem.treebytes;
+    char mem[16], freed[16], resident[16], packed[16], raw[16];
+    editorFormatSize(mem, sizeof(mem), total);
+    editorFormatSize(freed, sizeof(freed), E.mem.freebytes);
+    editorFormatSize(resident, sizeof(resident), editorColdResident() + E.cold.unpacked);
+    editorFormatSize(packed, sizeof(packed), E.cold.packed);
+    editorFormatSize(raw, sizeof(raw), E.cold.raw);
+    return snprintf(buf, bufsize, " | rows %s %.1fB/line free %s mallocs %ld | text %s packed %s of %s",
+            mem, (double)total / (E.nrows ? E.nrows : 1), freed, E.mem.mallocs, resident, packed, raw);
+}
+
+void editorDrawStatusBar(struct frame* f) {
+    frameMove(f, E.screenRows, 0);
+    f->attr = FEMTO_ATTR_INVERSE;
+    char status[160], rstatus[80];
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", E.filename ? E.filename : "[No Name]", E.nrows, E.sincemodif ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cursorY + 1, E.nrows);
-    if (len > E.screenCols) len = E.screenCols;
-    abAppend(ab, status, len);
+    if (E.save) {
+        while (len > 0 && status[len - 1] == ' ') len--;
+        len += snprintf(&status[len], sizeof(status) - len, " | saving %d%%", editorSaveProgress());
+    }
+    if (E.load && len < (int)sizeof(status)) {
+        while (len > 0 && status[len - 1] == ' ') len--;
+        len += snprintf(&status[len], sizeof(status) - len, " | loading %d%%", editorLoadProgress());
+    }
+    if (E.showstats && len < (int)sizeof(status)) {
+        while (len > 0 && status[len - 1] == ' ') len--;
+        if (E.showstats == 2) len += editorProfileString(&status[len], sizeof(status) - len);
+        else len += editorStatsString(&status[len], sizeof(status) - len);
+    }
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+    int rlen;
+    if (E.find.query || E.find.bad) rlen = editorFindStatus(rstatus, sizeof(rstatus));
+    else rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d", E.cursorY + 1, E.nrows);
+    if (rlen >= (int)sizeof(rstatus)) rlen = sizeof(rstatus) - 1;
+    framePuts(f, status, len);
 
-    while (len < E.screenCols) {
-        if (E.screenCols - len == rlen) {
-            abAppend(ab, rstatus, rlen);
+    while (f->x < E.screenCols) {
+        if (E.screenCols - f->x == rlen) {
+            framePuts(f, rstatus, rlen);
             break;
         } else {
-            abAppend(ab, " ", 1);
-            len++;
+            framePuts(f, " ", 1);
         }
     }
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    f->attr = FEMTO_ATTR_NORMAL;
 }
 
-void editorDrawMessageBar(struct abuf* ab) {
-    abAppend(ab, "\x1b[K", 3);
+void editorDrawMessageBar(struct frame* f) {
+    frameMove(f, E.screenRows + 1, 0);
     int msglen = strlen(E.statusmsg);
-    if (msglen > E.screenCols) msglen = E.screenCols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5) {
-        abAppend(ab, E.statusmsg, msglen);
+    if (msglen && (E.prompting || editorNow() - E.statusmsg_time < FEMTO_MSG_TIMEOUT)) {
+        framePuts(f, E.statusmsg, msglen);
     }
 }
 
 void editorRefreshScreen() {
+    long long start = E.prof.path ? editorNowNs() : 0;
     editorScroll();
 
+    frameClear(&E.back);
+    editorDrawRows(&E.back);
+    editorDrawStatusBar(&E.back);
+    editorDrawMessageBar(&E.back);
+
     struct abuf ab = ABUF_INIT;
 
     abAppend(&ab, "\x1b[?25l", 6);
-    // repositions cursor at row=1;col=1
-    abAppend(&ab, "\x1b[H", 3);
-
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorFlushFrame(&ab);
 
     // reposition after drawing '~'s
     char buf[32];
     // "\x1b[%d;%dH"
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
-            (E.cursorY - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+    if (E.wrap) {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+                (E.ry - E.rowoff) + 1, E.rx + 1);
+    } else {
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH",
+                (E.cursorY - E.rowoff) + 1, (E.rx - E.coloff) + 1);
+    }
 
     abAppend(&ab, buf, strlen(buf));
     abAppend(&ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
+    long long drawn = E.prof.path ? editorNowNs() : 0;
+    if (E.tty) write(STDOUT_FILENO, ab.b, ab.len);
+    if (E.prof.path) editorProfileFrame(start, drawn, ab.len);
     abFree(&ab);
+    E.lastframe = editorNow();
+}
+
+// picks up a new terminal size after SIGWINCH; the next refresh repaints
+void editorResize() {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) return;
+    int sub, top = E.wrap ? rowTreeFindLine(E.rowoff, &sub) : 0;
+    int oldcols = E.screenCols;
+    E.screenRows = rows > 3 ? rows - 2 : 1;
+    E.screenCols = cols > 0 ? cols : 1;
+    if (E.wrap) {
+        // the widths stay, only the lines they make change, unless a wide
+        // character moves to another line
+        if (E.screenCols != oldcols) editorWrapRemeasure();
+        rowTreeCount(E.root);
+        E.rowoff = rowTreeLine(top);
+    }
+    frameResize(&E.back, E.screenRows + 2, E.screenCols);
+    editorRenderReserve(E.screenRows * 2);
+    editorInvalidateScreen();
 }
 
 void editorSetStatusMessage(const char* fmt, ...) {
@@ -615,7 +5519,7 @@ void editorSetStatusMessage(const char* fmt, ...) {
     va_start(ap, fmt);
     vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
     va_end(ap);
-    E.statusmsg_time = time(NULL);
+    E.statusmsg_time = editorNow();
 }
 
 /*** input: mapping keys to functions ***/
@@ -630,13 +5534,15 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 
     while (1) {
         editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        E.prompting = 1;
+        if (!editorInputPending()) editorRefreshScreen();
 
         int c = editorReadKey();
+        E.prompting = 0;
         if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-            if (buflen != 0) {
-                buf[--buflen] = '\0';
-            }
+            // takes off a whole UTF-8 character
+            while (buflen != 0 && (buf[--buflen] & 0xc0) == 0x80);
+            buf[buflen] = '\0';
         } else if (c == '\x1b') {
             editorSetStatusMessage("");
             if (callback) callback(buf, c);
@@ -648,13 +5554,24 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
                 if (callback) callback(buf, c);
                 return buf;
             }
-        } else if (!iscntrl(c) && c < 128) {
+        } else if (c < 256 && (c >= 128 || !iscntrl(c))) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = realloc(buf, bufsize);
             }
             buf[buflen++] = c;
             buf[buflen] = '\0';
+        } else if (c == PASTE_KEY) {
+            // a prompt is one line: control characters are dropped
+            for (size_t i = 0; i < E.paste.len; i++) {
+                if (iscntrl((unsigned char)E.paste.text[i])) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = E.paste.text[i];
+            }
+            buf[buflen] = '\0';
         }
 
         if (callback) callback(buf, c);
@@ -663,21 +5580,22 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
 
 //allows user to move around screen
 void editorMoveCursor(int key) {
-    erow* row = (E.cursorY >= E.nrows) ? NULL : &E.row[E.cursorY];
+    // moving only needs row sizes, so rows passed over stay views
+    erow* row = (E.cursorY >= E.nrows) ? NULL : editorRowSeek(&E.pos, E.cursorY);
 
     switch (key) {
         case ARROW_LEFT:
             if (E.cursorX != 0) {
-                E.cursorX--;
+                E.cursorX = editorRowSnap(row, E.cursorX - 1);
             } else if (E.cursorY > 0) {
                 // set backspace=indent,eol
                 E.cursorY--;
-                E.cursorX = E.row[E.cursorY].size;
+                E.cursorX = editorRowSeek(&E.pos, E.cursorY)->size;
             }
             break;
         case ARROW_RIGHT:
             if (row && E.cursorX < row->size) {
-                E.cursorX++;
+                E.cursorX = editorRowNext(row, E.cursorX);
             } else if (row && E.cursorX == row->size) {
                 //moves right at EOL
                 E.cursorY++;
@@ -685,28 +5603,64 @@ void editorMoveCursor(int key) {
             }
             break;
         case ARROW_UP:
-            if (E.cursorY != 0) {
-                E.cursorY--;
-            }
-            break;
         case ARROW_DOWN:
-            if (E.cursorY < E.nrows) {
+            if (E.wrap) {
+                // by screen line, keeping the column on the line
+                int col, line = editorWrapCursor(&col);
+                editorWrapMoveTo(line + (key == ARROW_UP ? -1 : 1), col);
+            } else if (key == ARROW_UP && E.cursorY != 0) {
+                E.cursorY--;
+            } else if (key == ARROW_DOWN && E.cursorY < E.nrows) {
                 E.cursorY++;
             }
             break;
     }
-    row = (E.cursorY >= E.nrows) ? NULL : &E.row[E.cursorY];
+    row = (E.cursorY >= E.nrows) ? NULL : editorRowSeek(&E.pos, E.cursorY);
     int rowlen = row ? row->size : 0;
     if (E.cursorX > rowlen) {
         E.cursorX = rowlen;
     }
+    // the column kept from the row above or below may be inside a character
+    if (row) E.cursorX = editorRowSnap(row, E.cursorX);
+}
+
+// whether key c changes the buffer or writes it out
+int editorKeyEdits(int c) {
+    switch (c) {
+        case CTRL_KEY('q'):
+        case CTRL_KEY('f'):
+        case CTRL_KEY('l'):
+        case CTRL_KEY('t'):
+        case CTRL_KEY('w'):
+        case HOME_KEY:
+        case END_KEY:
+        case PAGE_UP:
+        case PAGE_DOWN:
+        case ARROW_UP:
+        case ARROW_DOWN:
+        case ARROW_LEFT:
+        case ARROW_RIGHT:
+        case '\x1b':
+        case WAKE_KEY:
+            return 0;
+    }
+    return 1;
 }
 
 // waits for keypress and returns it
 void editorProcessKeypress() {
     static int quit_times = FEMTO_QUIT_TIMES;
 
+    long long t0 = E.prof.path ? editorNowNs() : 0;
     int c = editorReadKey();
+    long long t1 = E.prof.path ? editorNowNs() : 0;
+    long long frames = E.prof.frames;
+    int y = E.cursorY;
+
+    if (E.load && editorKeyEdits(c)) {
+        editorSetStatusMessage("Still loading: edits and saves wait until the file is in");
+        return;
+    }
 
     switch (c) {
         case '\r': // enter key
@@ -714,11 +5668,13 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('q'):
+            editorSaveFinish(1);
             if (E.sincemodif && quit_times > 0) {
                 editorSetStatusMessage("File has unwritten changes. ", "Press Ctrl-Q %d times to quit without saving.", quit_times);
                 quit_times--;
                 return;
             }
+            editorJournalClose();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -738,7 +5694,7 @@ void editorProcessKeypress() {
 
         case END_KEY:
             if (E.cursorY < E.nrows) {
-                E.cursorX = E.row[E.cursorY].size;
+                E.cursorX = editorRowSeek(&E.pos, E.cursorY)->size;
             }
             break;
 
@@ -755,6 +5711,14 @@ void editorProcessKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             {
+                // the viewport may be stale when keys are applied in a batch
+                editorScroll();
+                if (E.wrap) {
+                    // straight to the line a screen away, in O(log n)
+                    int line = E.rowoff + (c == PAGE_UP ? -E.screenRows : 2 * E.screenRows - 1);
+                    editorWrapMoveTo(line, E.rx);
+                    break;
+                }
                 if (c == PAGE_UP) {
                     E.cursorY = E.rowoff;
                 } else if (c == PAGE_DOWN) {
@@ -779,7 +5743,32 @@ void editorProcessKeypress() {
             break;
 
         case CTRL_KEY('l'):
+            editorInvalidateScreen();
+            break;
+
+        case CTRL_KEY('w'):
+            editorWrapToggle();
+            break;
+
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
+
+        case CTRL_KEY('t'):
+            // memory counters, then key latency when profiling, then off
+            E.showstats = (E.showstats + 1) % (E.prof.path ? 3 : 2);
+            break;
+
+        case PASTE_KEY:
+            editorInsertText(E.paste.text, E.paste.len);
+            break;
+
         case '\x1b': //ignores escape key presses
+        case WAKE_KEY:
             break;
 
         default:
@@ -788,11 +5777,35 @@ void editorProcessKeypress() {
 
     }
 
+    editorGapRelease(y);
     quit_times = FEMTO_QUIT_TIMES;
+
+    // a key that ran a prompt drew frames of its own and is not timed
+    if (E.prof.path && c != WAKE_KEY && E.prof.frames == frames) {
+        long long ready = E.prof.ready > t0 ? E.prof.ready : t0;
+        histAdd(&E.prof.hist[PROF_PARSE], t1 - ready);
+        histAdd(&E.prof.hist[PROF_EDIT], editorNowNs() - t1);
+    }
+}
+
+// Queues keys as if they were typed, for running headless; they must stay
+// valid until editorRunPending has used them up.
+void editorFeed(const char* keys, size_t len) {
+    E.feed = keys;
+    E.feedlen = len;
+}
+
+// applies every queued key and adds the next chunk of loaded rows, if one is
+// ready, then draws one frame
+void editorRunPending() {
+    while (editorInputPending()) editorProcessKeypress();
+    if (!E.find.query) editorLoadStep(0);
+    editorRefreshScreen();
 }
 
 /*** initialize ***/
-void initEditor() {
+// sets up an editor with a rows x cols screen that is not tied to a terminal
+void initEditor(int rows, int cols) {
     E.cursorX = 0;
     E.cursorY = 0;
     E.rx = 0;
@@ -800,30 +5813,110 @@ void initEditor() {
     E.rowoff = 0;
     E.coloff = 0;
     E.nrows = 0;
-    E.row = NULL;
+    E.wrap = 0;
+    E.root = rowNodeNew(1);
+    E.pos.leaf = NULL;
+    E.gap.chars = NULL;
+    E.render.slot = NULL;
+    E.render.n = 0;
+    E.render.head = E.render.tail = -1;
+    E.render.stamp = 0;
+    E.hl.syntax = NULL;
+    E.hl.lo = E.hl.hi = E.hl.lexed = 0;
+    E.showstats = 0;
+    memset(&E.prof, 0, sizeof(E.prof));
+    E.find.current = -1;
+    E.save = NULL;
+    E.load = NULL;
+    E.follow.fd = E.follow.inotify = -1;
+    E.follow.off = 0;
+    E.follow.changed = E.follow.held = E.follow.nomap = 0;
+    E.follow.buf = NULL;
+    E.journal.fd = -1;
+    E.journal.path = NULL;
+    E.journal.buf = NULL;
+    E.journal.len = E.journal.cap = 0;
+    memset(&E.undo, 0, sizeof(E.undo));
+    E.undo.budget = FEMTO_UNDO_BYTES;
+    memset(&E.cold, 0, sizeof(E.cold));
+    E.cold.scan = -1;
+    E.cold.budget = FEMTO_COLD_BYTES;
+    E.in.head = E.in.tail = 0;
+    E.paste.text = NULL;
+    E.paste.len = E.paste.cap = 0;
+    if (pipe(E.wake) == -1) die("pipe");
+    fcntl(E.wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.wake[1], F_SETFL, O_NONBLOCK);
     E.filename = NULL;
+    E.map = NULL;
+    E.mapsize = 0;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
+    E.frontvalid = 0;
+    E.lastframe = 0;
+    E.winch = 0;
+    E.woken = 0;
+    E.prompting = 0;
+    E.tty = 0;
+    E.feed = NULL;
+    E.feedlen = 0;
+
+    E.screenRows = rows - 2;
+    E.screenCols = cols;
+    frameResize(&E.back, E.screenRows + 2, E.screenCols);
+    editorRenderReserve(E.screenRows * 2 > FEMTO_RENDER_ROWS ? E.screenRows * 2 : FEMTO_RENDER_ROWS);
+}
+
+// reads keys from and draws to the terminal, which is already in raw mode
+void initTerminal() {
+    int rows, cols;
+    if (getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+    initEditor(rows, cols);
+    E.tty = 1;
 
-    if (getWindowSize(&E.screenRows, &E.screenCols) == -1) die("getWindowSize");
-    E.screenRows -= 2;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
 }
 
+#ifndef FEMTO_CORE
 int main(int argc, char* argv[]) {
+    // -f follows the file as it grows, like tail -f
+    int follow = argc >= 3 && strcmp(argv[1], "-f") == 0;
+    if (follow) argv++, argc--;
+
     enableRawMode();
-    initEditor();
+    initTerminal();
+    editorProfileStart(getenv("FEMTO_PROFILE"));
+    // FEMTO_UNDO_MB sets the memory budget of the undo history
+    if (getenv("FEMTO_UNDO_MB")) E.undo.budget = (size_t)atol(getenv("FEMTO_UNDO_MB")) << 20;
+    // FEMTO_COLD_MB sets how much row text is kept before cold rows are packed
+    if (getenv("FEMTO_COLD_MB")) E.cold.budget = (size_t)atol(getenv("FEMTO_COLD_MB")) << 20;
+    E.follow.nomap = follow;
     if (argc >= 2) {
         // opens filename specified
         editorOpen(argv[1]);
     }
 
-    const char* message = "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find";
+    const char* message = "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctrl-W = wrap";
     editorSetStatusMessage(message);
+    if (follow && editorFollowStart() == -1) {
+        editorSetStatusMessage("Can't follow %s: %s", argv[1], strerror(errno));
+    }
+    // rows read from a followed file are not edits, so it has no journal
+    if (!follow) editorJournalOpen();
 
     while (1) {
         editorRefreshScreen();
-        editorProcessKeypress();
+        // every key already typed is applied before the next frame
+        do {
+            editorProcessKeypress();
+        } while (editorInputPending());
     }
 
     return 0;
 }
+#endif
@@ -0,0 +1,18 @@
+#ifndef FEMTO_H
+#define FEMTO_H
+
+#include <stddef.h>
+
+// The editor without its terminal, for driving it from other programs such
+// as the benchmark in bench/. Build femto.c with -DFEMTO_CORE to leave out
+// main(). There is one editor per process.
+
+void initEditor(int rows, int cols);
+void editorOpen(char* filename);
+void editorSetFilename(char* filename);
+void editorFeed(const char* keys, size_t len);
+void editorRunPending();
+int editorSaveFinish(int wait);
+void editorLoadFinish();
+
+#endif